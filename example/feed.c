@@ -0,0 +1,138 @@
+/*  feed.c: parse an NBT file fed in small fragments with NBT_Parser, and check it against NBT_Parse_Opt
+    and against a lazy document with packed lists
+    Not copyrighted, provided to the public domain
+    This file is part of the libnbt library
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nbt.h"
+
+// Compare a tree with the same tree parsed with NBT_PARSE_LAZY | NBT_PARSE_PACK_LISTS,
+// reading it only through the getters, so lazy nodes are parsed (and lists packed) on first access
+int same_tree(NBT* tree, NBT* lazy) {
+    if (tree->type != lazy->type) {
+        return 0;
+    }
+    NBT* child;
+    NBT* other;
+    int32_t i = 0;
+    switch (tree->type) {
+        case TAG_Byte:
+        case TAG_Short:
+        case TAG_Int:
+        case TAG_Long:
+            return tree->value_i == lazy->value_i;
+        case TAG_Float:
+        case TAG_Double:
+            return tree->value_d == lazy->value_d;
+        case TAG_Byte_Array:
+        case TAG_String:
+            return tree->value_a.len == lazy->value_a.len && !memcmp(tree->value_a.value, lazy->value_a.value, tree->value_a.len);
+        case TAG_Int_Array:
+            return tree->value_a.len == lazy->value_a.len && !memcmp(tree->value_a.value, lazy->value_a.value, tree->value_a.len * 4);
+        case TAG_Long_Array:
+            return tree->value_a.len == lazy->value_a.len && !memcmp(tree->value_a.value, lazy->value_a.value, tree->value_a.len * 8);
+        case TAG_List:
+            if (tree->child && tree->child->type <= TAG_Double) {
+                // a list of numbers is packed, it has elements but no children
+                for (child = tree->child; child; child = child->next, i ++) {
+                    if (child->type >= TAG_Float ? NBT_GetListDouble(lazy, i) != child->value_d : NBT_GetListInt(lazy, i) != child->value_i) {
+                        return 0;
+                    }
+                }
+                int32_t len;
+                return NBT_GetListData(lazy, NULL, &len) != NULL && len == i && NBT_GetFirstChild(lazy) == NULL;
+            }
+            // fall through
+        case TAG_Compound:
+            other = NBT_GetFirstChild(lazy);
+            for (child = tree->child; child && other; child = child->next, other = other->next) {
+                if (!same_tree(child, other)) {
+                    return 0;
+                }
+            }
+            return child == NULL && other == NULL;
+        default:
+            return 0;
+    }
+}
+
+int main(int argc, char** argv) {
+
+    // Get parameters
+    size_t fragment = 1;
+    if (argc < 2) {
+        printf("Usage: %s <nbtfile> [fragment size]\n", argv[0]);
+        return -1;
+    }
+    if (argc > 2 && atoi(argv[2]) > 0) {
+        fragment = atoi(argv[2]);
+    }
+    FILE* fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+        printf("Cannot open file %s!\n", argv[1]);
+        return -2;
+    }
+
+    // Feed the file as it is read, fragment bytes at a time
+    NBT_Parser* parser = NBT_Parser_Init();
+    uint8_t* buffer = malloc(fragment);
+    size_t n;
+    size_t total = 0;
+    while ((n = fread(buffer, 1, fragment, fp)) > 0) {
+        total += n;
+        if (NBT_Parser_Feed(parser, buffer, n) != 0) {
+            break;
+        }
+    }
+    NBT_Error error;
+    NBT* root = NBT_Parser_Finish(parser, &error);
+    NBT_Parser_Free(parser);
+    free(buffer);
+    if (root == NULL) {
+        printf("NBT parse failed! errid=%x position=%d\n", error.errid, error.position);
+        fclose(fp);
+        return -3;
+    }
+    printf("NBT parse OK! %zu bytes in fragments of %zu\n", total, fragment);
+
+    // Parse the whole file at once, and compare both trees packed uncompressed
+    uint8_t* data = malloc(total);
+    fseek(fp, 0, SEEK_SET);
+    fread(data, 1, total, fp);
+    fclose(fp);
+    NBT* whole = NBT_Parse(data, total);
+
+    size_t size1 = NBT_PackedSize(root);
+    size_t size2 = NBT_PackedSize(whole);
+    uint8_t* packed1 = malloc(size1);
+    uint8_t* packed2 = malloc(size2);
+    NBT_Pack_Opt(root, packed1, &size1, NBT_Compression_NONE, NULL);
+    NBT_Pack_Opt(whole, packed2, &size2, NBT_Compression_NONE, NULL);
+    if (size1 == size2 && memcmp(packed1, packed2, size1) == 0) {
+        printf("Same as NBT_Parse_Opt\n");
+    } else {
+        printf("Different from NBT_Parse_Opt!\n");
+    }
+    free(packed1);
+    free(packed2);
+
+    // Parse it once more into a lazy document with packed lists, and compare through the getters
+    NBT_Document* doc = NBT_Document_Init_Opt(NBT_PARSE_LAZY | NBT_PARSE_PACK_LISTS);
+    NBT* lazy = NBT_Parse_Document(doc, data, total, NULL);
+    if (whole && lazy && same_tree(whole, lazy)) {
+        printf("Same as a lazy document with packed lists\n");
+    } else {
+        printf("Different from a lazy document with packed lists!\n");
+    }
+    NBT_Document_Free(doc);
+    free(data);
+
+    // Remember to use NBT_Free after use
+    NBT_Free(root);
+    NBT_Free(whole);
+
+    return 0;
+}
@@ -48,6 +48,10 @@ int main(int argc, char** argv) {
     // Parse raw data to NBT structure
     int errcount = MCA_ParseAll(mca);
 
+    // The same paths are looked up in every chunk, compile them once
+    NBT_Path* xPath = NBT_CompilePath("Level.xPos");
+    NBT_Path* zPath = NBT_CompilePath("Level.zPos");
+
     int i;
     int emptycount = -errcount;
     int successcount = 0;
@@ -56,8 +60,8 @@ int main(int argc, char** argv) {
             emptycount ++;
             continue;
         }
-        NBT* xPos = NBT_GetChild_Deep(mca->data[i], "Level", "xPos", NULL);
-        NBT* zPos = NBT_GetChild_Deep(mca->data[i], "Level", "zPos", NULL);
+        NBT* xPos = NBT_Eval(xPath, mca->data[i]);
+        NBT* zPos = NBT_Eval(zPath, mca->data[i]);
         if (xPos == NULL || zPos == NULL) {
             printf("Cannot find position data of chunk%d,%d\n", i%32, i/32);
             errcount++;
@@ -75,6 +79,8 @@ int main(int argc, char** argv) {
     printf("Load finished! %d chunks passed position check, %d chunks are empty, and %d chunks have error\n", successcount, emptycount, errcount);
 
     // remember to release the memory
+    NBT_FreePath(xPath);
+    NBT_FreePath(zPath);
     MCA_Free(mca);
     // //also free the buffer, if you use it
     // free(buffer);
@@ -16,35 +16,321 @@
 
 #include "nbt.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef _MSC_VER
+#include <io.h>
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Worker threads of MCA_ParseAll_Parallel, pass -DLIBNBT_NO_THREADS to run it on the calling thread only
+#ifndef LIBNBT_NO_THREADS
+#ifdef _MSC_VER
+typedef HANDLE LIBNBT_Thread;
+typedef volatile LONG LIBNBT_Counter;
+#define LIBNBT_FETCH_ADD(counter) (InterlockedIncrement(counter) - 1)
+#else
+#include <pthread.h>
+typedef pthread_t LIBNBT_Thread;
+typedef int LIBNBT_Counter;
+#define LIBNBT_FETCH_ADD(counter) __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED)
+#endif
+#else
+typedef int LIBNBT_Counter;
+#define LIBNBT_FETCH_ADD(counter) ((*(counter)) ++)
+#endif
 
 #ifndef LIBNBT_USE_LIBDEFLATE
     #include <zlib.h>
-    int LIBNBT_decompress_gzip(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize);
-    int LIBNBT_compress_gzip(uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize);
-    int LIBNBT_decompress_zlib(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize);
-    #define LIBNBT_compress_zlib(a,b,c,d) compress((a), (b), (c), (d))
 #else
     #include "libdeflate/libdeflate.h"
-    int LIBNBT_decompress_gzip(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize);
-    int LIBNBT_compress_gzip(uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize);
-    int LIBNBT_decompress_zlib(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize);
-    int LIBNBT_compress_zlib(uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize);
 #endif
+int LIBNBT_decompress(NBT_Context* ctx, int compression, uint8_t* src, size_t srcsize, size_t* destsize);
+int LIBNBT_compress(NBT_Context* ctx, int compression, uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize);
+int LIBNBT_level(int compression);
+size_t LIBNBT_inflate_size(NBT_Context* ctx, int compression, const uint8_t* src, size_t srcsize);
+
+// NBT_Compression without the NBT_LEVEL_* bits
+#define LIBNBT_FORMAT(compression) ((compression) & ~NBT_LEVEL_MASK)
 
 typedef struct NBT_Buffer {
     uint8_t* data;
     size_t len;
     size_t pos;
+    // set by NBT_Pack_ToSink, writers flush a full buffer into it instead of failing
+    struct NBT_Stream* stream;
 } NBT_Buffer;
 
+// Output of NBT_Pack_ToSink, which is compressed (unless NBT_Compression_NONE) and passed to the sink
+typedef struct NBT_Stream {
+    const NBT_Sink* sink;
+    int compression;
+    // uncompressed bytes written so far
+    size_t total;
+    int error;
+#ifndef LIBNBT_USE_LIBDEFLATE
+    z_stream strm;
+    uint8_t* out;
+#endif
+} NBT_Stream;
+
+// Size of the NBT_Pack_ToSink buffers, uncompressed and compressed
+#define LIBNBT_SINK_CHUNK (1 << 16)
+
+// State of NBT_Extract. Each path is matched one segment per nesting level
+typedef struct NBT_Extract_State {
+    // next unmatched segment of each path
+    const char** cursor;
+    // nesting level each path is matched to, -1 when resolved,
+    // LIBNBT_EXTRACT_PENDING(level) when found at a tag of that level which is not scanned yet
+    int* depth;
+    NBT_Value* out;
+    int count;
+    int remaining;
+    // whether out values may point into the scanned data, which outlives the scan
+    int alive;
+} NBT_Extract_State;
+
+// Open List/Compound of a parser
+typedef struct NBT_Parse_Frame {
+    NBT* node;
+    NBT* last;
+    uint32_t remaining;     // elements left in a list, children so far in a compound
+    uint8_t type;           // element type of a list
+} NBT_Parse_Frame;
+
+// Open List/Compound of NBT_Validate, which keeps all frames on the C stack
+typedef struct NBT_Validate_Frame {
+    uint32_t remaining;     // elements left in a list
+    uint8_t type;           // element type of a list, TAG_End for a compound
+    uint8_t compound;
+} NBT_Validate_Frame;
+
+// Frames LIBNBT_parse_children holds on the C stack before it moves to the heap
+#define LIBNBT_PARSE_FRAMES 32
+
+// Hash index of the children of a compound, open addressing. It does not notice children changed
+// by hand, NBT_AddChild/NBT_RemoveChild keep it in sync, and NBT_DropIndex discards it
+typedef struct NBT_Index_Slot {
+    uint32_t hash;
+    NBT* node;
+} NBT_Index_Slot;
+
+struct NBT_Index {
+    uint32_t count;
+    uint32_t mask;
+    NBT_Index_Slot slots[];
+};
+
+// Interned keys. Strings live in the arena of an internal document, slots is an open addressing table of them
+typedef struct NBT_Atom_Slot {
+    uint32_t hash;
+    uint32_t len;
+    char* str;
+} NBT_Atom_Slot;
+
+struct NBT_Atoms {
+    NBT_Document* strings;
+    NBT_Atom_Slot* slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+#define LIBNBT_ATOMS_SLOTS 1024
+
+// Compiled path of NBT_CompilePath. Keys are stored right after the segments
+typedef struct NBT_Path_Segment {
+    const char* key;
+    size_t keylen;
+    uint32_t hash;
+    int64_t index;  // list index, -1 for a key
+} NBT_Path_Segment;
+
+struct NBT_Path {
+    int count;
+    NBT_Path_Segment segments[];
+};
+
+// NBT_PARSE_INDEX only indexes compounds with at least this many children
+#define LIBNBT_INDEX_MIN 16
+
+// What the bytes a push parser is waiting for are
+enum {
+    LIBNBT_PUSH_TYPE,       // tag type of the root, or of the next child of a compound
+    LIBNBT_PUSH_KEYLEN,
+    LIBNBT_PUSH_KEY,
+    LIBNBT_PUSH_SCALAR,     // payload of a number tag
+    LIBNBT_PUSH_STRLEN,
+    LIBNBT_PUSH_ARRLEN,
+    LIBNBT_PUSH_DATA,       // payload of a string or array
+    LIBNBT_PUSH_LISTHDR,    // element type and count of a list
+    LIBNBT_PUSH_DONE,
+};
+
+struct NBT_Parser {
+    int state;
+    int error;
+    // bytes of the current state go to dest, need in total
+    uint8_t tmp[8];
+    uint8_t* dest;
+    size_t need;
+    size_t have;
+    // bytes allocated at dest, array payloads grow as they arrive (see LIBNBT_push_grow)
+    size_t capacity;
+    // tree being built, current is the node being filled
+    NBT* root;
+    NBT* current;
+    NBT_Parse_Frame* stack;
+    int depth;
+    int stacksize;
+    // uncompressed bytes consumed, and whether anything came after the root tag
+    size_t position;
+    int leftover;
+    // NBT_Compression of the input, 0 until the first two bytes are seen
+    int compression;
+    uint8_t head[2];
+    int headlen;
+#ifndef LIBNBT_USE_LIBDEFLATE
+    z_stream strm;
+    uint8_t* inflated;
+#else
+    // libdeflate can not inflate a stream, compressed input is collected until NBT_Parser_Finish
+    uint8_t* compressed;
+    size_t compressedlen;
+    size_t compressedsize;
+#endif
+};
+
+#define LIBNBT_PUSH_CHUNK (1 << 16)
+
+// Codec state and buffers kept between calls, see NBT_Context_Init.
+// Internal calls without a context use a temporary one on the stack
+struct NBT_Context {
+#ifndef LIBNBT_USE_LIBDEFLATE
+    // set up on first use, then reset for each call. ready has a LIBNBT_READY_* bit for each
+    z_stream inflater;
+    z_stream deflater[2];   // gzip, zlib
+    int level[2];           // current level of each deflater
+    int ready;
+#else
+    struct libdeflate_decompressor* decompressor;
+    struct libdeflate_compressor* compressor;
+    int level;              // level the compressor was allocated with
+#endif
+    // decompressed input, and the expected size of it, see NBT_Context_SizeHint
+    uint8_t* scratch;
+    size_t scratchsize;
+    size_t hint;
+    // uncompressed output of pack, before it is compressed
+    uint8_t* staging;
+    size_t stagingsize;
+};
+
+// Smallest decompression buffer, and the guessed ratio of NBT data when its size is unknown
+#define LIBNBT_INFLATE_MIN (1 << 12)
+#define LIBNBT_INFLATE_RATIO 4
+
+// Chunks of a region processed by several threads. Each thread claims the next chunk from
+// a shared cursor until none is left, with its own context. Larger chunks go first.
+typedef struct NBT_Parallel_Job {
+    MCA* mca;
+    // size of the work of each chunk, 0 to skip it
+    uint32_t weight[CHUNKS_IN_REGION];
+    uint16_t order[CHUNKS_IN_REGION];
+    int count;
+    LIBNBT_Counter next;
+    void (*work)(struct NBT_Parallel_Job* job, NBT_Context* ctx, int index);
+    // NBT_Compression of MCA_PackAll
+    int compression;
+    NBT_Error errors[CHUNKS_IN_REGION];
+} NBT_Parallel_Job;
+
+// Upper limit of threads of one job
+#define LIBNBT_MAX_THREADS 256
+
+#define LIBNBT_READY_INFLATE 0x1
+#define LIBNBT_READY_DEFLATE(i) (0x2 << (i))
+
+// NBT_Extract stops scanning once every path is resolved
+#define LIBNBT_EXTRACT_DONE 1
+#define LIBNBT_EXTRACT_PENDING(level) (-2 - (level))
+
 #define isValidTag(tag) ((tag)>TAG_End && (tag)<=TAG_Long_Array)
 
+// Nesting limit of Lists and Compounds, same as Minecraft
+#define LIBNBT_MAX_DEPTH 512
+
+// State of NBT_Parse_Flat, open holds the List/Compound nodes being filled
+typedef struct NBT_Flat_Builder {
+    NBT_Flat* flat;
+    uint32_t open[LIBNBT_MAX_DEPTH + 1];
+    int depth;
+    // key of the next node
+    uint32_t key;
+    uint16_t keylen;
+    int error;
+} NBT_Flat_Builder;
+
+// Upper bound of the compressed size of n bytes, for both zlib and libdeflate, gzip or zlib wrapped
+#define LIBNBT_COMPRESS_BOUND(n) ((n) + (n) / 1000 + 64)
+
+// Payload size of each tag, or element size of array tags. 0 for other variable size tags
+const uint8_t LIBNBT_TAG_SIZE[256] = {0, 1, 2, 4, 8, 4, 8, 1, 0, 0, 0, 4, 8};
+
+// Size of the fixed part of each payload: the number itself, or the length prefix
+const uint8_t LIBNBT_TAG_HEAD[256] = {0, 1, 2, 4, 8, 4, 8, 4, 2, 5, 0, 4, 4};
+
+// Arena blocks of a document. Allocations are bumped from the current block,
+// a new block is chained when it runs out. Reset merges all blocks into one.
+#define LIBNBT_ARENA_BLOCK (1 << 16)
+#define LIBNBT_ARENA_ALIGN 8
+
+typedef struct NBT_Arena_Block {
+    struct NBT_Arena_Block* next;
+    size_t size;
+    size_t used;
+} NBT_Arena_Block;
+
+#define LIBNBT_ARENA_HEADER ((sizeof(NBT_Arena_Block) + LIBNBT_ARENA_ALIGN - 1) & ~(size_t)(LIBNBT_ARENA_ALIGN - 1))
+
+// Input of one parse. Lazy nodes point here to find their payload
+struct NBT_Source {
+    NBT_Document* doc;
+    uint8_t* data;
+    size_t len;
+};
+
+// Decompressed input kept alive by a zero-copy or lazy document
+typedef struct NBT_Kept_Buffer {
+    struct NBT_Kept_Buffer* next;
+    uint8_t* data;
+} NBT_Kept_Buffer;
+
+struct NBT_Document {
+    // first block and the block currently bumped from
+    NBT_Arena_Block* head;
+    NBT_Arena_Block* current;
+    // NBT_PARSE_* flags
+    int flags;
+    // buffers views of the trees point into, freed on reset
+    NBT_Kept_Buffer* kept;
+    // input being parsed
+    struct NBT_Source* source;
+    // keys are interned here when set, see NBT_Document_SetAtoms
+    NBT_Atoms* atoms;
+};
+
 #ifdef _MSC_VER
 #include <stdlib.h>
 #define bswap_16(x) _byteswap_ushort(x)
@@ -63,6 +349,19 @@ typedef struct NBT_Buffer {
 #include <byteswap.h>
 #endif
 
+// SIMD byte swap of Int/Long arrays, x86 with GCC or clang only. The kernels are
+// compiled for their own target and picked at runtime, others use the scalar loop
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(LIBNBT_NO_SIMD)
+#define LIBNBT_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Big endian loads without bounds check, for data already checked
+#define LIBNBT_LOAD16(p) bswap_16(*(uint16_t*)(p))
+#define LIBNBT_LOAD32(p) bswap_32(*(uint32_t*)(p))
+#define LIBNBT_LOAD64(p) bswap_64(*(uint64_t*)(p))
+#define LIBNBT_STORE16(p, v) (*(uint16_t*)(p) = bswap_16(v))
+
 #ifndef _MSC_VER
 #define BUFFER_SPRINTF(buffer, str...) {                        \
     char* buf = (char*)&(buffer)->data[(buffer)->pos];          \
@@ -94,7 +393,9 @@ typedef struct NBT_Buffer {
 #endif
 
 
-NBT* LIBNBT_create_NBT(uint8_t type);
+NBT_Arena_Block* LIBNBT_arena_block(size_t size);
+void* LIBNBT_alloc(NBT_Document* doc, size_t size);
+NBT* LIBNBT_create_NBT(NBT_Document* doc, uint8_t type);
 NBT_Buffer* LIBNBT_init_buffer(uint8_t* data, int length);
 int LIBNBT_getUint8(NBT_Buffer* buffer, uint8_t* result);
 int LIBNBT_getUint16(NBT_Buffer* buffer, uint16_t* result);
@@ -104,34 +405,297 @@ int LIBNBT_writeUint8(NBT_Buffer* buffer, uint8_t value);
 int LIBNBT_writeUint16(NBT_Buffer* buffer, uint16_t value);
 int LIBNBT_writeUint32(NBT_Buffer* buffer, uint32_t value);
 int LIBNBT_writeUint64(NBT_Buffer* buffer, uint64_t value);
+uint8_t* LIBNBT_reserve(NBT_Buffer* buffer, size_t size);
+int LIBNBT_flush(NBT_Buffer* buffer, size_t size);
+int LIBNBT_write_elements(NBT_Buffer* buffer, const void* src, size_t size, size_t count);
 int LIBNBT_getFloat(NBT_Buffer* buffer, float* result);
 int LIBNBT_getDouble(NBT_Buffer* buffer, double* result);
 int LIBNBT_writeFloat(NBT_Buffer* buffer, float value);
 int LIBNBT_writeDouble(NBT_Buffer* buffer, double value);
-int LIBNBT_getKey(NBT_Buffer* buffer, char** result);
-int LIBNBT_parse_value(NBT* saveto, NBT_Buffer* buffer, uint8_t skipkey);
+int LIBNBT_key_length(NBT* root);
+int LIBNBT_getKey(NBT_Buffer* buffer, char** result, NBT_Document* doc, NBT_Atoms* atoms);
+int LIBNBT_parse_value(NBT* saveto, NBT_Buffer* buffer, uint8_t skipkey, NBT_Document* doc, NBT_Atoms* atoms);
+void LIBNBT_parse_number(NBT* saveto, const uint8_t* data);
+int LIBNBT_parse_payload(NBT* saveto, NBT_Buffer* buffer, NBT_Document* doc);
+int LIBNBT_parse_children(NBT* saveto, NBT_Buffer* buffer, NBT_Document* doc, NBT_Atoms* atoms);
+int LIBNBT_parse_lazy(NBT* saveto, NBT_Buffer* buffer, NBT_Document* doc);
+int LIBNBT_materialize(NBT* root);
+int LIBNBT_validate_payload(NBT_Buffer* buffer, uint8_t type);
+int LIBNBT_validate_children(NBT_Buffer* buffer, uint8_t type);
+int LIBNBT_validate_value(NBT_Buffer* buffer);
+int LIBNBT_skip_value(NBT_Buffer* buffer, uint8_t type, int depth);
 int LIBNBT_snbt_write_space(NBT_Buffer* buffer, int spacecount);
-int LIBNBT_snbt_write_key(NBT_Buffer* buffer, char* key);
-int LIBNBT_snbt_write_number(NBT_Buffer* buffer, uint64_t value, char* key, int type);
-int LIBNBT_snbt_write_point(NBT_Buffer* buffer, double value, char* key, int type);
-int LIBNBT_snbt_write_array(NBT_Buffer* buffer, void* value, int length, char* key, int type);
-int LIBNBT_snbt_write_string(NBT_Buffer* buffer, char* value, int length, char* key);
+int LIBNBT_snbt_write_key(NBT_Buffer* buffer, char* key, int keylen);
+int LIBNBT_snbt_write_number(NBT_Buffer* buffer, uint64_t value, char* key, int keylen, int type);
+int LIBNBT_snbt_write_point(NBT_Buffer* buffer, double value, char* key, int keylen, int type);
+int LIBNBT_snbt_write_array(NBT_Buffer* buffer, void* value, int length, char* key, int keylen, int type, int bigendian);
+int LIBNBT_snbt_write_string(NBT_Buffer* buffer, char* value, int length, char* key, int keylen);
 int LIBNBT_snbt_write_compound(NBT_Buffer* buffer, NBT* root, int level, int space, int curlevel, int isarray);
 int LIBNBT_snbt_write_nbt(NBT_Buffer* buffer, NBT* root, int level, int space, int curlevel);
 int LIBNBT_nbt_write_nbt(NBT_Buffer* buffer, NBT* root, int writekey);
-int LIBNBT_nbt_write_key(NBT_Buffer* buffer, char* key, int type);
+int LIBNBT_nbt_write_key(NBT_Buffer* buffer, char* key, int keylen, int type);
 int LIBNBT_nbt_write_number(NBT_Buffer* buffer, uint64_t value, char* key, int type);
 int LIBNBT_nbt_write_point(NBT_Buffer* buffer, double value, char* key, int type);
-int LIBNBT_nbt_write_array(NBT_Buffer* buffer, void* value, int32_t len, char* key, int type);
+int LIBNBT_nbt_write_array(NBT_Buffer* buffer, void* value, int32_t len, char* key, int type, int bigendian);
 int LIBNBT_nbt_write_string(NBT_Buffer* buffer, void* value, int32_t len, char* key);
 int LIBNBT_nbt_write_compound(NBT_Buffer* buffer, NBT* root);
 int LIBNBT_nbt_write_list(NBT_Buffer* buffer, NBT* root);
+int LIBNBT_nbt_write_lazy(NBT_Buffer* buffer, NBT* root);
+size_t LIBNBT_nbt_size(NBT* root, int withkey);
+int LIBNBT_stream_init(NBT_Stream* stream, const NBT_Sink* sink, int compression);
+int LIBNBT_stream_write(NBT_Stream* stream, const uint8_t* data, size_t length, int finish);
+void LIBNBT_stream_end(NBT_Stream* stream);
+int LIBNBT_sink_file(void* user, const uint8_t* data, size_t length);
+int LIBNBT_sink_fd(void* user, const uint8_t* data, size_t length);
+int LIBNBT_cpu_count(void);
+void LIBNBT_parallel_worker(NBT_Parallel_Job* job);
+void LIBNBT_parallel_run(NBT_Parallel_Job* job, int nthreads);
+int LIBNBT_chunk_compare(const void* a, const void* b);
+void LIBNBT_parallel_parse(NBT_Parallel_Job* job, NBT_Context* ctx, int index);
+void LIBNBT_parallel_pack(NBT_Parallel_Job* job, NBT_Context* ctx, int index);
+int LIBNBT_pack_alloc(NBT_Context* ctx, NBT* root, uint8_t** buffer, size_t* length, NBT_Compression compression, NBT_Error* errid);
+int LIBNBT_pack_staged(NBT_Context* ctx, NBT* root, size_t size, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid);
+int64_t LIBNBT_double_to_int64(double value);
+int LIBNBT_mca_read(uint8_t* data, size_t length, MCA* mca, int skip_chunk_error, int copy);
+uint8_t* LIBNBT_map_file(const char* filename, size_t* length);
+void LIBNBT_unmap_file(uint8_t* data, size_t length);
 void LIBNBT_fill_err(NBT_Error* err, int errid, int position);
+void LIBNBT_context_init(NBT_Context* ctx);
+void LIBNBT_context_clear(NBT_Context* ctx);
+int LIBNBT_context_grow(uint8_t** buffer, size_t* size, size_t need);
+int LIBNBT_uncompress(NBT_Context* ctx, uint8_t* data, size_t length, uint8_t** result, size_t* resultlen);
+NBT* LIBNBT_parse_data(NBT_Context* ctx, uint8_t* data, size_t length, NBT_Document* doc, NBT_Atoms* atoms, NBT_Error* errid);
+const char* LIBNBT_path_segment(const char* path, const char** key, size_t* keylen, int64_t* index);
+int LIBNBT_extract_fill(NBT_Buffer* buffer, size_t start, uint8_t type, NBT_Value* out, int alive);
+int LIBNBT_extract_match(NBT_Extract_State* state, int depth, const char* key, size_t keylen, int64_t index);
+int LIBNBT_extract_walk(NBT_Buffer* buffer, NBT_Extract_State* state, uint8_t type, int depth);
+int LIBNBT_visit_value(NBT_Buffer* buffer, const NBT_Visitor* visitor, void* user, uint8_t type, int depth);
+int LIBNBT_push_wait(NBT_Parser* p, int state, uint8_t* dest, size_t need);
+int LIBNBT_push_begin_value(NBT_Parser* p);
+int LIBNBT_push_value_done(NBT_Parser* p);
+int LIBNBT_push_step(NBT_Parser* p);
+int LIBNBT_push_process(NBT_Parser* p, const uint8_t* data, size_t length);
+int LIBNBT_push_frame(NBT_Parser* p, NBT* node, uint32_t remaining, uint8_t type);
+int LIBNBT_push_grow(NBT_Parser* p, size_t size);
+int LIBNBT_push_detect(NBT_Parser* p);
+int LIBNBT_push_feed(NBT_Parser* p, const uint8_t* data, size_t length);
+int LIBNBT_document_keep(NBT_Document* doc, uint8_t* data);
+void LIBNBT_document_release(NBT_Document* doc);
+uint32_t LIBNBT_hash(const char* key, size_t keylen);
+char* LIBNBT_intern(NBT_Atoms* atoms, const char* key, size_t keylen);
+struct NBT_Index* LIBNBT_index_build(NBT* root, uint32_t count, NBT_Document* doc);
+void LIBNBT_index_insert(struct NBT_Index* index, NBT* child);
+NBT* LIBNBT_index_find(struct NBT_Index* index, const char* key, size_t keylen, uint32_t hash);
+struct NBT_Index* LIBNBT_get_index(NBT* root);
+NBT_Flat* LIBNBT_flat_init(void);
+NBT_Flat_Node* LIBNBT_flat_node(NBT_Flat* flat, uint8_t type);
+int LIBNBT_flat_data(NBT_Flat* flat, size_t len, size_t align, uint32_t* offset);
+int LIBNBT_flat_key(NBT_Flat* flat, const char* key, size_t keylen, uint32_t* offset);
+int LIBNBT_flat_payload(NBT_Flat* flat, uint32_t node, const void* value, int32_t len, int bigendian);
+int LIBNBT_flat_from_tree(NBT_Flat* flat, NBT* root, int haskey);
+NBT* LIBNBT_flat_to_tree(const NBT_Flat* flat, uint32_t i);
+NBT_Flat_Node* LIBNBT_flat_add(NBT_Flat_Builder* b, uint8_t type);
+int LIBNBT_flat_on_key(void* user, const char* key, int keylen, NBT_Tags type);
+int LIBNBT_flat_on_value(void* user, const NBT_Value* value);
+int LIBNBT_flat_on_begin_compound(void* user);
+int LIBNBT_flat_on_begin_list(void* user, NBT_Tags type, int32_t count);
+int LIBNBT_flat_on_end(void* user);
+void LIBNBT_bswap_copy32(void* dest, const void* src, size_t count);
+void LIBNBT_bswap_copy64(void* dest, const void* src, size_t count);
+void LIBNBT_bswap_copy(void* dest, const void* src, size_t size, size_t count);
+int LIBNBT_list_get(NBT* root, int32_t index, NBT* element);
+
+#ifdef LIBNBT_SIMD_X86
+// 0: scalar, 1: SSE2, 2: AVX2, -1: not detected yet
+int LIBNBT_simd_level = -1;
+
+int LIBNBT_simd_detect(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return 2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return 1;
+    }
+    return 0;
+}
+
+// Each kernel swaps whole vectors and returns the number of elements done
+__attribute__((target("sse2")))
+size_t LIBNBT_bswap32_sse2(void* dest, const void* src, size_t count) {
+    size_t i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)((const uint32_t*)src + i));
+        // swap bytes of each 16 bit word, then the words of each 32 bit element
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)((uint32_t*)dest + i), v);
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+size_t LIBNBT_bswap64_sse2(void* dest, const void* src, size_t count) {
+    size_t i;
+    for (i = 0; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)((const uint64_t*)src + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i*)((uint64_t*)dest + i), v);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t LIBNBT_bswap32_avx2(void* dest, const void* src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i;
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)((const uint32_t*)src + i));
+        _mm256_storeu_si256((__m256i*)((uint32_t*)dest + i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t LIBNBT_bswap64_avx2(void* dest, const void* src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)((const uint64_t*)src + i));
+        _mm256_storeu_si256((__m256i*)((uint64_t*)dest + i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+#endif
+
+// Copy count 32 bit elements, swapping the byte order of each. dest may be the same as src
+void LIBNBT_bswap_copy32(void* dest, const void* src, size_t count) {
+    size_t i = 0;
+#ifdef LIBNBT_SIMD_X86
+    // relaxed atomics, several threads may detect it at the same time
+    int level = __atomic_load_n(&LIBNBT_simd_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        level = LIBNBT_simd_detect();
+        __atomic_store_n(&LIBNBT_simd_level, level, __ATOMIC_RELAXED);
+    }
+    if (level == 2) {
+        i = LIBNBT_bswap32_avx2(dest, src, count);
+    } else if (level == 1) {
+        i = LIBNBT_bswap32_sse2(dest, src, count);
+    }
+#endif
+    for (; i < count; i ++) {
+        uint32_t value;
+        memcpy(&value, (const uint32_t*)src + i, 4);
+        value = bswap_32(value);
+        memcpy((uint32_t*)dest + i, &value, 4);
+    }
+}
+
+// Copy count 64 bit elements, swapping the byte order of each. dest may be the same as src
+void LIBNBT_bswap_copy64(void* dest, const void* src, size_t count) {
+    size_t i = 0;
+#ifdef LIBNBT_SIMD_X86
+    // relaxed atomics, several threads may detect it at the same time
+    int level = __atomic_load_n(&LIBNBT_simd_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        level = LIBNBT_simd_detect();
+        __atomic_store_n(&LIBNBT_simd_level, level, __ATOMIC_RELAXED);
+    }
+    if (level == 2) {
+        i = LIBNBT_bswap64_avx2(dest, src, count);
+    } else if (level == 1) {
+        i = LIBNBT_bswap64_sse2(dest, src, count);
+    }
+#endif
+    for (; i < count; i ++) {
+        uint64_t value;
+        memcpy(&value, (const uint64_t*)src + i, 8);
+        value = bswap_64(value);
+        memcpy((uint64_t*)dest + i, &value, 8);
+    }
+}
+
+// Byte swap count elements of size bytes, for number lists
+void LIBNBT_bswap_copy(void* dest, const void* src, size_t size, size_t count) {
+    size_t i;
+    switch (size) {
+        case 1:
+            memmove(dest, src, count);
+            break;
+        case 2:
+            for (i = 0; i < count; i ++) {
+                uint16_t value;
+                memcpy(&value, (const uint16_t*)src + i, 2);
+                value = bswap_16(value);
+                memcpy((uint16_t*)dest + i, &value, 2);
+            }
+            break;
+        case 4:
+            LIBNBT_bswap_copy32(dest, src, count);
+            break;
+        case 8:
+            LIBNBT_bswap_copy64(dest, src, count);
+            break;
+        default:
+            break;
+    }
+}
+
+NBT_Arena_Block* LIBNBT_arena_block(size_t size) {
+    NBT_Arena_Block* block = malloc(LIBNBT_ARENA_HEADER + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+// Allocate from the document arena, or from the heap when doc is NULL
+void* LIBNBT_alloc(NBT_Document* doc, size_t size) {
+    if (doc == NULL) {
+        return malloc(size);
+    }
+    size = (size + LIBNBT_ARENA_ALIGN - 1) & ~(size_t)(LIBNBT_ARENA_ALIGN - 1);
+    NBT_Arena_Block* block = doc->current;
+    while (block->used + size > block->size) {
+        if (block->next == NULL) {
+            size_t blocksize = block->size > LIBNBT_ARENA_BLOCK ? block->size : LIBNBT_ARENA_BLOCK;
+            while (blocksize < size) {
+                blocksize <<= 1;
+            }
+            block->next = LIBNBT_arena_block(blocksize);
+            if (block->next == NULL) {
+                return NULL;
+            }
+        }
+        block = block->next;
+    }
+    doc->current = block;
+    void* ret = (uint8_t*)block + LIBNBT_ARENA_HEADER + block->used;
+    block->used += size;
+    return ret;
+}
 
-NBT* LIBNBT_create_NBT(uint8_t type) {
-    NBT* root = malloc(sizeof(NBT));
+NBT* LIBNBT_create_NBT(NBT_Document* doc, uint8_t type) {
+    NBT* root = LIBNBT_alloc(doc, sizeof(NBT));
+    if (root == NULL) {
+        return NULL;
+    }
     memset(root, 0, sizeof(NBT));
     root->type = type;
+    if (doc) {
+        root->flags = NBT_FLAG_DOCUMENT;
+    }
     return root;
 }
 
@@ -143,6 +707,7 @@ NBT_Buffer* LIBNBT_init_buffer(uint8_t* data, int length) {
     buffer->data = data;
     buffer->len = length;
     buffer->pos = 0;
+    buffer->stream = NULL;
     return buffer;
 }
 
@@ -156,7 +721,7 @@ int LIBNBT_getUint8(NBT_Buffer* buffer, uint8_t* result) {
 }
 
 int LIBNBT_writeUint8(NBT_Buffer* buffer, uint8_t value) {
-    if (buffer->pos + 1 > buffer->len) {
+    if (buffer->pos + 1 > buffer->len && !LIBNBT_flush(buffer, 1)) {
         return 0;
     }
     buffer->data[buffer->pos] = value;
@@ -174,8 +739,51 @@ int LIBNBT_getUint16(NBT_Buffer* buffer, uint16_t* result) {
     return 2;
 }
 
+// Take size bytes of the output at once, NULL if it does not fit
+uint8_t* LIBNBT_reserve(NBT_Buffer* buffer, size_t size) {
+    if (buffer->len - buffer->pos < size && !LIBNBT_flush(buffer, size)) {
+        return NULL;
+    }
+    uint8_t* dest = buffer->data + buffer->pos;
+    buffer->pos += size;
+    return dest;
+}
+
+// Pass a full buffer to its stream and start over, then whether size bytes fit. 0 without a stream
+int LIBNBT_flush(NBT_Buffer* buffer, size_t size) {
+    if (buffer->stream == NULL || LIBNBT_stream_write(buffer->stream, buffer->data, buffer->pos, 0)) {
+        return 0;
+    }
+    buffer->pos = 0;
+    return size <= buffer->len;
+}
+
+// Copy count elements of size bytes to the output in big endian.
+// Flushed in pieces with a stream, otherwise it all has to fit
+int LIBNBT_write_elements(NBT_Buffer* buffer, const void* src, size_t size, size_t count) {
+    const uint8_t* from = src;
+    while (buffer->len - buffer->pos < size * count) {
+        if (buffer->stream == NULL) {
+            return 0;
+        }
+        size_t n = (buffer->len - buffer->pos) / size;
+        LIBNBT_bswap_copy(buffer->data + buffer->pos, from, size, n);
+        buffer->pos += n * size;
+        from += n * size;
+        count -= n;
+        if (!LIBNBT_flush(buffer, size)) {
+            return 0;
+        }
+    }
+    if (count) {
+        LIBNBT_bswap_copy(buffer->data + buffer->pos, from, size, count);
+        buffer->pos += size * count;
+    }
+    return 1;
+}
+
 int LIBNBT_writeUint16(NBT_Buffer* buffer, uint16_t value) {
-    if (buffer->pos + 2 > buffer->len) {
+    if (buffer->pos + 2 > buffer->len && !LIBNBT_flush(buffer, 2)) {
         return 0;
     }
     *(uint16_t*)(buffer->data + buffer->pos) = bswap_16(value);
@@ -194,7 +802,7 @@ int LIBNBT_getUint32(NBT_Buffer* buffer, uint32_t* result) {
 }
 
 int LIBNBT_writeUint32(NBT_Buffer* buffer, uint32_t value) {
-    if (buffer->pos + 4 > buffer->len) {
+    if (buffer->pos + 4 > buffer->len && !LIBNBT_flush(buffer, 4)) {
         return 0;
     }
     *(uint32_t*)(buffer->data + buffer->pos) = bswap_32(value);
@@ -213,7 +821,7 @@ int LIBNBT_getUint64(NBT_Buffer* buffer, uint64_t* result) {
 }
 
 int LIBNBT_writeUint64(NBT_Buffer* buffer, uint64_t value) {
-    if (buffer->pos + 8 > buffer->len) {
+    if (buffer->pos + 8 > buffer->len && !LIBNBT_flush(buffer, 8)) {
         return 0;
     }
     *(uint64_t*)(buffer->data + buffer->pos) = bswap_64(value);
@@ -233,7 +841,7 @@ int LIBNBT_getFloat(NBT_Buffer* buffer, float* result) {
 }
 
 int LIBNBT_writeFloat(NBT_Buffer* buffer, float value) {
-    if (buffer->pos + 4 > buffer->len) {
+    if (buffer->pos + 4 > buffer->len && !LIBNBT_flush(buffer, 4)) {
         return 0;
     }
     *(uint32_t*)(buffer->data + buffer->pos) = bswap_32(*(uint32_t*)&value);
@@ -253,7 +861,7 @@ int LIBNBT_getDouble(NBT_Buffer* buffer, double* result) {
 }
 
 int LIBNBT_writeDouble(NBT_Buffer* buffer, double value) {
-    if (buffer->pos + 8 > buffer->len) {
+    if (buffer->pos + 8 > buffer->len && !LIBNBT_flush(buffer, 8)) {
         return 0;
     }
     *(uint64_t*)(buffer->data + buffer->pos) = bswap_64(*(uint64_t*)&value);
@@ -261,7 +869,17 @@ int LIBNBT_writeDouble(NBT_Buffer* buffer, double value) {
     return 8;
 }
 
-int LIBNBT_getKey(NBT_Buffer* buffer, char** result) {
+int LIBNBT_key_length(NBT* root) {
+    if (root->key == NULL) {
+        return 0;
+    }
+    if (root->flags & NBT_FLAG_VIEW) {
+        return root->keylen;
+    }
+    return strlen(root->key);
+}
+
+int LIBNBT_getKey(NBT_Buffer* buffer, char** result, NBT_Document* doc, NBT_Atoms* atoms) {
     uint16_t len;
     if(!LIBNBT_getUint16(buffer, &len)) {
         return 0;
@@ -273,114 +891,59 @@ int LIBNBT_getKey(NBT_Buffer* buffer, char** result) {
     if (buffer->pos + len > buffer->len) {
         return 0;
     }
-    *result = malloc(len + 1);
+    if (atoms) {
+        *result = LIBNBT_intern(atoms, (char*)buffer->data + buffer->pos, len);
+        if (*result == NULL) {
+            return 0;
+        }
+        buffer->pos += len;
+        return 2 + len;
+    }
+    if (doc && (doc->flags & NBT_PARSE_ZEROCOPY)) {
+        *result = (char*)buffer->data + buffer->pos;
+        buffer->pos += len;
+        return 2 + len;
+    }
+    *result = LIBNBT_alloc(doc, len + 1);
+    if (*result == NULL) {
+        return 0;
+    }
     memcpy(*result, buffer->data + buffer->pos, len);
     (*result)[len] = 0;
     buffer->pos += len;
     return 2 + len;
 }
 
-int LIBNBT_parse_value(NBT* saveto, NBT_Buffer* buffer, uint8_t skipkey) {
-    
-    if (saveto == NULL || buffer == NULL || buffer->data == NULL) {
-        return LIBNBT_ERROR_INTERNAL;
-    }
-
-    uint8_t type = saveto->type;
-    if (type == TAG_End) {
-        if (!LIBNBT_getUint8(buffer, &type)) {
-            return LIBNBT_ERROR_EARLY_EOF;
-        }
-        if (!isValidTag(type)) {
-            return LIBNBT_ERROR_INVALID_DATA;
-        }
-        saveto->type = type;
-    }
-
-    if (!skipkey) {
-        char* key;
-        if (!LIBNBT_getKey(buffer, &key)) {
-            return LIBNBT_ERROR_EARLY_EOF;
-        }
-        saveto->key = key;
+// Skip a payload of the given type, checking its structure without building any node
+int LIBNBT_skip_value(NBT_Buffer* buffer, uint8_t type, int depth) {
+    if (depth > LIBNBT_MAX_DEPTH) {
+        return LIBNBT_ERROR_INVALID_DATA;
     }
-
+    size_t size = LIBNBT_TAG_SIZE[type];
     switch (type) {
-        case TAG_Byte: {
-            uint8_t value;
-            if (!LIBNBT_getUint8(buffer, &value)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            saveto->value_i = value;
-            break;
-        }
-        case TAG_Short: {
-            uint16_t value;
-            if (!LIBNBT_getUint16(buffer, &value)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            saveto->value_i = value;
-            break;
-        }
-        case TAG_Int: {
-            uint32_t value;
-            if (!LIBNBT_getUint32(buffer, &value)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            saveto->value_i = value;
-            break;
-        }
-        case TAG_Long: {
-            uint64_t value;
-            if (!LIBNBT_getUint64(buffer, &value)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            saveto->value_i = value;
-            break;
-        }
-        case TAG_Float: {
-            float value;
-            if (!LIBNBT_getFloat(buffer, &value)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            saveto->value_d = value;
+        case TAG_Byte:
+        case TAG_Short:
+        case TAG_Int:
+        case TAG_Long:
+        case TAG_Float:
+        case TAG_Double:
             break;
-        }
-        case TAG_Double: {
-            double value;
-            if (!LIBNBT_getDouble(buffer, &value)) {
+        case TAG_String: {
+            uint16_t len;
+            if (!LIBNBT_getUint16(buffer, &len)) {
                 return LIBNBT_ERROR_EARLY_EOF;
             }
-            saveto->value_d = value;
+            size = len;
             break;
         }
-        case TAG_Byte_Array: {
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array: {
             uint32_t len;
             if (!LIBNBT_getUint32(buffer, &len)) {
                 return LIBNBT_ERROR_EARLY_EOF;
             }
-            saveto->value_a.value = malloc(len);
-            saveto->value_a.len = len;
-            if (buffer->pos + len > buffer->len) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            memcpy(saveto->value_a.value, buffer->data + buffer->pos, len);
-            buffer->pos += len;
-            break;
-        }
-        case TAG_String: {
-            uint16_t len;
-            if (!LIBNBT_getUint16(buffer, &len)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            saveto->value_a.value = malloc(len + 1);
-            saveto->value_a.len = len + 1;
-            if (buffer->pos + len > buffer->len) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            memcpy(saveto->value_a.value, buffer->data + buffer->pos, len);
-            ((char*)saveto->value_a.value)[len] = 0;
-            buffer->pos += len;
+            size = (size_t)len * LIBNBT_TAG_SIZE[type];
             break;
         }
         case TAG_List: {
@@ -392,128 +955,616 @@ int LIBNBT_parse_value(NBT* saveto, NBT_Buffer* buffer, uint8_t skipkey) {
             if (!LIBNBT_getUint32(buffer, &len)) {
                 return LIBNBT_ERROR_EARLY_EOF;
             }
-            if (listtype == TAG_End && len != 0) {
+            if (len == 0) {
+                return 0;
+            }
+            if (!isValidTag(listtype)) {
                 return LIBNBT_ERROR_INVALID_DATA;
             }
-            int i;
-            NBT* last = NULL;
+            if (LIBNBT_TAG_SIZE[listtype] && listtype <= TAG_Double) {
+                // list of numbers, skip all elements at once
+                size = (size_t)len * LIBNBT_TAG_SIZE[listtype];
+                break;
+            }
+            uint32_t i;
             for (i = 0; i < len; i ++) {
-                NBT* child = LIBNBT_create_NBT(listtype);
-                int ret = LIBNBT_parse_value(child, buffer, 1);
+                int ret = LIBNBT_skip_value(buffer, listtype, depth + 1);
                 if (ret) {
                     return ret;
                 }
-                if (i == 0) {
-                    last = child;
-                    saveto->child = child;
-                } else {
-                    last->next = child;
-                    child->prev = last;
-                    last = child;
-                }
             }
-            break;
+            return 0;
         }
         case TAG_Compound: {
-            NBT* last = NULL;
             while (1) {
-                uint8_t listtype;
-                if (!LIBNBT_getUint8(buffer, &listtype)) {
+                uint8_t childtype;
+                if (!LIBNBT_getUint8(buffer, &childtype)) {
                     return LIBNBT_ERROR_EARLY_EOF;
                 }
-                if (listtype == 0) {
-                    break;
+                if (childtype == TAG_End) {
+                    return 0;
+                }
+                if (!isValidTag(childtype)) {
+                    return LIBNBT_ERROR_INVALID_DATA;
+                }
+                uint16_t keylen;
+                if (!LIBNBT_getUint16(buffer, &keylen)) {
+                    return LIBNBT_ERROR_EARLY_EOF;
+                }
+                if (buffer->pos + keylen > buffer->len) {
+                    return LIBNBT_ERROR_EARLY_EOF;
                 }
-                NBT* child = LIBNBT_create_NBT(listtype);
-                int ret = LIBNBT_parse_value(child, buffer, 0);
+                buffer->pos += keylen;
+                int ret = LIBNBT_skip_value(buffer, childtype, depth + 1);
                 if (ret) {
                     return ret;
                 }
-                if (last == NULL) {
-                    saveto->child = child;
-                    last = child;
-                } else {
-                    last->next = child;
-                    child->prev = last;
-                    last = child;
-                }
-            }
-            break;
-        }
-        case TAG_Int_Array: {
-            uint32_t len;
-            if (!LIBNBT_getUint32(buffer, &len)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            len *= 4;
-            saveto->value_a.value = malloc(len);
-            saveto->value_a.len = len/4;
-            if (buffer->pos + len > buffer->len) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            memcpy(saveto->value_a.value, buffer->data + buffer->pos, len);
-            buffer->pos += len;
-            int i;
-            uint32_t* value = (uint32_t*)saveto->value_a.value;
-            for (i = 0; i < len/4; i ++) {
-                value[i] = bswap_32(value[i]);
-            }
-            break;
-        }
-        case TAG_Long_Array: {
-            uint32_t len;
-            if (!LIBNBT_getUint32(buffer, &len)) {
-                return LIBNBT_ERROR_EARLY_EOF;
-            }
-            len *= 8;
-            saveto->value_a.value = malloc(len);
-            saveto->value_a.len = len/8;
-            if (buffer->pos + len > buffer->len) {
-                return LIBNBT_ERROR_EARLY_EOF;
             }
-            memcpy(saveto->value_a.value, buffer->data + buffer->pos, len);
-            buffer->pos += len;
-            int i;
-            uint64_t* value = (uint64_t*)saveto->value_a.value;
-            for (i = 0; i < len/8; i ++) {
-                value[i] = bswap_64(value[i]);
-            }
-            break;
         }
         default:
-            return LIBNBT_ERROR_INTERNAL;
-    }
-    return 0;
-}
-
-int LIBNBT_snbt_write_space(NBT_Buffer* buffer, int spacecount) {
-    if (spacecount < 0) {
-        return 0;
-    }
-    char* buf = (char*)&buffer->data[buffer->pos];
-    int maxlen = buffer->len - buffer->pos;
-    if (maxlen <= spacecount) {
-        return LIBNBT_ERROR_BUFFER_OVERFLOW;
+            return LIBNBT_ERROR_INVALID_DATA;
     }
-    int i;
-    for (i = 0; i < spacecount; i++) {
-        buf[i] = ' ';
+    if (buffer->len - buffer->pos < size) {
+        return LIBNBT_ERROR_EARLY_EOF;
     }
-    buf[i] = 0;
-    buffer->pos += spacecount;
+    buffer->pos += size;
     return 0;
 }
 
-int LIBNBT_snbt_write_key(NBT_Buffer* buffer, char* key) {
-    if (key && key[0]) {
-        BUFFER_SPRINTF(buffer, "%s:", key);
+int LIBNBT_parse_value(NBT* saveto, NBT_Buffer* buffer, uint8_t skipkey, NBT_Document* doc, NBT_Atoms* atoms) {
+    
+    if (saveto == NULL || buffer == NULL || buffer->data == NULL) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+
+    uint8_t type = saveto->type;
+    if (type == TAG_End) {
+        if (!LIBNBT_getUint8(buffer, &type)) {
+            return LIBNBT_ERROR_EARLY_EOF;
+        }
+        if (!isValidTag(type)) {
+            return LIBNBT_ERROR_INVALID_DATA;
+        }
+        saveto->type = type;
+    }
+
+    if (doc && (doc->flags & NBT_PARSE_ZEROCOPY)) {
+        saveto->flags |= NBT_FLAG_VIEW;
+    }
+
+    if (!skipkey) {
+        char* key;
+        int keylen = LIBNBT_getKey(buffer, &key, doc, atoms);
+        if (!keylen) {
+            return LIBNBT_ERROR_EARLY_EOF;
+        }
+        if (atoms && key) {
+            saveto->flags |= NBT_FLAG_ATOM;
+        }
+        saveto->key = key;
+        saveto->keylen = keylen - 2;
+    }
+
+    if (type == TAG_List || type == TAG_Compound) {
+        if (doc && (doc->flags & NBT_PARSE_LAZY)) {
+            return LIBNBT_parse_lazy(saveto, buffer, doc);
+        }
+        return LIBNBT_parse_children(saveto, buffer, doc, atoms);
+    }
+    if (buffer->len - buffer->pos < LIBNBT_TAG_HEAD[type]) {
+        return LIBNBT_ERROR_EARLY_EOF;
+    }
+    return LIBNBT_parse_payload(saveto, buffer, doc);
+}
+
+// Decode a number payload. Integers are zero extended, same as LIBNBT_getUint*
+void LIBNBT_parse_number(NBT* saveto, const uint8_t* data) {
+    switch (saveto->type) {
+        case TAG_Byte:
+            saveto->value_i = data[0];
+            break;
+        case TAG_Short:
+            saveto->value_i = LIBNBT_LOAD16(data);
+            break;
+        case TAG_Int:
+            saveto->value_i = LIBNBT_LOAD32(data);
+            break;
+        case TAG_Long:
+            saveto->value_i = LIBNBT_LOAD64(data);
+            break;
+        case TAG_Float: {
+            uint32_t value = LIBNBT_LOAD32(data);
+            float f;
+            memcpy(&f, &value, sizeof(f));
+            saveto->value_d = f;
+            break;
+        }
+        case TAG_Double: {
+            uint64_t value = LIBNBT_LOAD64(data);
+            memcpy(&saveto->value_d, &value, sizeof(double));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Parse the payload of any tag but List/Compound. Its fixed part (LIBNBT_TAG_HEAD) is already bounds checked
+int LIBNBT_parse_payload(NBT* saveto, NBT_Buffer* buffer, NBT_Document* doc) {
+    uint8_t type = saveto->type;
+    uint8_t* data = buffer->data + buffer->pos;
+    size_t len;
+
+    if (type <= TAG_Double) {
+        LIBNBT_parse_number(saveto, data);
+        buffer->pos += LIBNBT_TAG_SIZE[type];
+        return 0;
+    }
+    if (type == TAG_String) {
+        len = LIBNBT_LOAD16(data);
+        buffer->pos += 2;
+        saveto->value_a.len = len + 1;
+    } else {
+        saveto->value_a.len = LIBNBT_LOAD32(data);
+        len = (size_t)(uint32_t)saveto->value_a.len * LIBNBT_TAG_SIZE[type];
+        buffer->pos += 4;
+    }
+    if (buffer->len - buffer->pos < len) {
+        return LIBNBT_ERROR_EARLY_EOF;
+    }
+    data = buffer->data + buffer->pos;
+    buffer->pos += len;
+
+    int raw = type == TAG_Byte_Array || type == TAG_String || (doc && (doc->flags & NBT_PARSE_RAW_ARRAYS));
+    if (raw && type != TAG_String && type != TAG_Byte_Array) {
+        saveto->flags |= NBT_FLAG_BIG_ENDIAN;
+    }
+    if (raw && doc && (doc->flags & NBT_PARSE_ZEROCOPY)) {
+        saveto->value_a.value = data;
+        return 0;
+    }
+    if (type == TAG_String) {
+        saveto->value_a.value = LIBNBT_alloc(doc, len + 1);
+        if (saveto->value_a.value == NULL) {
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        memcpy(saveto->value_a.value, data, len);
+        ((char*)saveto->value_a.value)[len] = 0;
+        return 0;
+    }
+    saveto->value_a.value = LIBNBT_alloc(doc, len ? len : 1);
+    if (saveto->value_a.value == NULL) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (raw) {
+        memcpy(saveto->value_a.value, data, len);
+    } else if (type == TAG_Int_Array) {
+        LIBNBT_bswap_copy32(saveto->value_a.value, data, len / 4);
+    } else {
+        LIBNBT_bswap_copy64(saveto->value_a.value, data, len / 8);
+    }
+    return 0;
+}
+
+// Parse the children of a List/Compound, buffer is right after its key.
+// Nested Lists/Compounds are walked with an explicit stack of open frames, not by recursion.
+// In a lazy document, only the direct children are parsed.
+int LIBNBT_parse_children(NBT* saveto, NBT_Buffer* buffer, NBT_Document* doc, NBT_Atoms* atoms) {
+    NBT_Parse_Frame local[LIBNBT_PARSE_FRAMES];
+    NBT_Parse_Frame* stack = local;
+    int stacksize = LIBNBT_PARSE_FRAMES;
+    int depth = 0;
+    int lazy = doc && (doc->flags & NBT_PARSE_LAZY);
+    int zerocopy = doc && (doc->flags & NBT_PARSE_ZEROCOPY);
+    int index = doc && (doc->flags & NBT_PARSE_INDEX);
+    int pack = doc && (doc->flags & NBT_PARSE_PACK_LISTS);
+    int ret = 0;
+    NBT* node = saveto;
+
+    while (1) {
+        // node is a List/Compound right after its key, open it
+        NBT_Parse_Frame* frame;
+        if (depth == LIBNBT_MAX_DEPTH) {
+            ret = LIBNBT_ERROR_INVALID_DATA;
+            break;
+        }
+        if (depth == stacksize) {
+            NBT_Parse_Frame* newstack = malloc(sizeof(NBT_Parse_Frame) * stacksize * 2);
+            if (newstack == NULL) {
+                ret = LIBNBT_ERROR_INTERNAL;
+                break;
+            }
+            memcpy(newstack, stack, sizeof(NBT_Parse_Frame) * stacksize);
+            if (stack != local) {
+                free(stack);
+            }
+            stack = newstack;
+            stacksize *= 2;
+        }
+        frame = &stack[depth ++];
+        frame->node = node;
+        frame->last = NULL;
+        frame->remaining = 0;
+        frame->type = TAG_End;
+        if (node->type == TAG_List) {
+            if (buffer->len - buffer->pos < 5) {
+                ret = LIBNBT_ERROR_EARLY_EOF;
+                break;
+            }
+            frame->type = buffer->data[buffer->pos];
+            frame->remaining = LIBNBT_LOAD32(buffer->data + buffer->pos + 1);
+            buffer->pos += 5;
+            if (frame->remaining != 0 && !isValidTag(frame->type)) {
+                ret = LIBNBT_ERROR_INVALID_DATA;
+                break;
+            }
+            size_t size = LIBNBT_TAG_SIZE[frame->type];
+            if (frame->type <= TAG_Double && frame->remaining != 0) {
+                // list of numbers, one bounds check for all elements
+                if ((buffer->len - buffer->pos) / size < frame->remaining) {
+                    ret = LIBNBT_ERROR_EARLY_EOF;
+                    break;
+                }
+                if (pack) {
+                    node->packed.value = LIBNBT_alloc(doc, frame->remaining * size);
+                    if (node->packed.value == NULL) {
+                        ret = LIBNBT_ERROR_INTERNAL;
+                        break;
+                    }
+                    LIBNBT_bswap_copy(node->packed.value, buffer->data + buffer->pos, size, frame->remaining);
+                    node->packed.len = frame->remaining;
+                    node->packed.type = frame->type;
+                    node->flags |= NBT_FLAG_PACKED;
+                    buffer->pos += frame->remaining * size;
+                    frame->remaining = 0;
+                }
+                uint32_t i;
+                for (i = 0; i < frame->remaining; i ++) {
+                    NBT* child = LIBNBT_create_NBT(doc, frame->type);
+                    if (child == NULL) {
+                        ret = LIBNBT_ERROR_INTERNAL;
+                        break;
+                    }
+                    if (zerocopy) {
+                        child->flags |= NBT_FLAG_VIEW;
+                    }
+                    LIBNBT_parse_number(child, buffer->data + buffer->pos);
+                    buffer->pos += size;
+                    if (frame->last == NULL) {
+                        node->child = child;
+                    } else {
+                        frame->last->next = child;
+                        child->prev = frame->last;
+                    }
+                    frame->last = child;
+                }
+                if (ret) {
+                    break;
+                }
+                frame->remaining = 0;
+            }
+        }
+
+        // parse children until another List/Compound is met, or all frames are closed
+        node = NULL;
+        while (depth > 0) {
+            frame = &stack[depth - 1];
+            uint8_t type;
+            if (frame->node->type == TAG_Compound) {
+                // compound: type, key and the fixed part of the payload are checked at once
+                if (buffer->pos >= buffer->len) {
+                    ret = LIBNBT_ERROR_EARLY_EOF;
+                    break;
+                }
+                type = buffer->data[buffer->pos];
+                if (type == TAG_End) {
+                    buffer->pos ++;
+                    if (index && frame->remaining >= LIBNBT_INDEX_MIN) {
+                        frame->node->index = LIBNBT_index_build(frame->node, frame->remaining, doc);
+                        if (frame->node->index) {
+                            frame->node->flags |= NBT_FLAG_INDEX;
+                        }
+                    }
+                    depth --;
+                    continue;
+                }
+                if (!isValidTag(type)) {
+                    ret = LIBNBT_ERROR_INVALID_DATA;
+                    break;
+                }
+                if (buffer->len - buffer->pos < 3) {
+                    ret = LIBNBT_ERROR_EARLY_EOF;
+                    break;
+                }
+                size_t keylen = LIBNBT_LOAD16(buffer->data + buffer->pos + 1);
+                if (buffer->len - buffer->pos - 3 < keylen + LIBNBT_TAG_HEAD[type]) {
+                    ret = LIBNBT_ERROR_EARLY_EOF;
+                    break;
+                }
+                buffer->pos += 3;
+                frame->remaining ++;
+                node = LIBNBT_create_NBT(doc, type);
+                if (node == NULL) {
+                    ret = LIBNBT_ERROR_INTERNAL;
+                    break;
+                }
+                node->keylen = keylen;
+                if (keylen == 0) {
+                    node->key = NULL;
+                } else if (atoms) {
+                    node->key = LIBNBT_intern(atoms, (char*)buffer->data + buffer->pos, keylen);
+                    if (node->key == NULL) {
+                        ret = LIBNBT_ERROR_INTERNAL;
+                        break;
+                    }
+                    node->flags |= NBT_FLAG_ATOM;
+                } else if (zerocopy) {
+                    node->key = (char*)buffer->data + buffer->pos;
+                } else {
+                    node->key = LIBNBT_alloc(doc, keylen + 1);
+                    if (node->key == NULL) {
+                        ret = LIBNBT_ERROR_INTERNAL;
+                        break;
+                    }
+                    memcpy(node->key, buffer->data + buffer->pos, keylen);
+                    node->key[keylen] = 0;
+                }
+                buffer->pos += keylen;
+            } else {
+                if (frame->remaining == 0) {
+                    depth --;
+                    continue;
+                }
+                frame->remaining --;
+                type = frame->type;
+                if (buffer->len - buffer->pos < LIBNBT_TAG_HEAD[type]) {
+                    ret = LIBNBT_ERROR_EARLY_EOF;
+                    break;
+                }
+                node = LIBNBT_create_NBT(doc, type);
+                if (node == NULL) {
+                    ret = LIBNBT_ERROR_INTERNAL;
+                    break;
+                }
+            }
+            if (zerocopy) {
+                node->flags |= NBT_FLAG_VIEW;
+            }
+            if (frame->last == NULL) {
+                frame->node->child = node;
+            } else {
+                frame->last->next = node;
+                node->prev = frame->last;
+            }
+            frame->last = node;
+
+            if (type == TAG_List || type == TAG_Compound) {
+                if (!lazy) {
+                    break;
+                }
+                ret = LIBNBT_parse_lazy(node, buffer, doc);
+            } else {
+                ret = LIBNBT_parse_payload(node, buffer, doc);
+            }
+            node = NULL;
+            if (ret) {
+                break;
+            }
+        }
+        if (ret || depth == 0) {
+            break;
+        }
+    }
+
+    if (stack != local) {
+        free(stack);
+    }
+    return ret;
+}
+
+// Record the payload range of a List/Compound, its children are parsed on first access
+int LIBNBT_parse_lazy(NBT* saveto, NBT_Buffer* buffer, NBT_Document* doc) {
+    size_t start = buffer->pos;
+    int ret = LIBNBT_skip_value(buffer, saveto->type, 0);
+    if (ret) {
+        return ret;
+    }
+    saveto->flags |= NBT_FLAG_LAZY;
+    saveto->lazy.source = doc->source;
+    saveto->lazy.offset = start;
+    saveto->lazy.len = buffer->pos - start;
+    return 0;
+}
+
+int LIBNBT_materialize(NBT* root) {
+    if (!(root->flags & NBT_FLAG_LAZY)) {
+        return 0;
+    }
+    struct NBT_Source* source = root->lazy.source;
+    NBT_Buffer buffer;
+    buffer.data = source->data;
+    buffer.pos = root->lazy.offset;
+    buffer.len = root->lazy.offset + root->lazy.len;
+
+    NBT_Document* doc = source->doc;
+    struct NBT_Source* current = doc->source;
+    doc->source = source;
+    // keep the node lazy if parsing fails, so the error repeats instead of a partial tree
+    uint16_t flags = root->flags;
+    uint32_t offset = root->lazy.offset;
+    uint32_t len = root->lazy.len;
+    root->flags &= ~NBT_FLAG_LAZY;
+    root->child = NULL;
+    root->index = NULL;
+    int ret = LIBNBT_parse_children(root, &buffer, doc, doc->atoms);
+    doc->source = current;
+    if (ret) {
+        root->flags = flags;
+        root->lazy.source = source;
+        root->lazy.offset = offset;
+        root->lazy.len = len;
+    }
+    return ret;
+}
+
+// Check a payload which is not a List/Compound, same as LIBNBT_parse_payload.
+// The fixed part of the payload is already checked
+int LIBNBT_validate_payload(NBT_Buffer* buffer, uint8_t type) {
+    const uint8_t* data = buffer->data + buffer->pos;
+    size_t len;
+    if (type <= TAG_Double) {
+        buffer->pos += LIBNBT_TAG_SIZE[type];
+        return 0;
+    }
+    if (type == TAG_String) {
+        len = LIBNBT_LOAD16(data);
+        buffer->pos += 2;
+    } else {
+        len = (size_t)LIBNBT_LOAD32(data) * LIBNBT_TAG_SIZE[type];
+        buffer->pos += 4;
+    }
+    if (buffer->len - buffer->pos < len) {
+        return LIBNBT_ERROR_EARLY_EOF;
+    }
+    buffer->pos += len;
+    return 0;
+}
+
+// Check the payload of a List/Compound, same as LIBNBT_parse_children but without any node
+int LIBNBT_validate_children(NBT_Buffer* buffer, uint8_t type) {
+    NBT_Validate_Frame stack[LIBNBT_MAX_DEPTH];
+    int depth = 0;
+
+    while (1) {
+        // a List/Compound of type starts here, open it
+        NBT_Validate_Frame* frame;
+        if (depth == LIBNBT_MAX_DEPTH) {
+            return LIBNBT_ERROR_INVALID_DATA;
+        }
+        frame = &stack[depth ++];
+        frame->remaining = 0;
+        frame->type = TAG_End;
+        frame->compound = type == TAG_Compound;
+        if (!frame->compound) {
+            if (buffer->len - buffer->pos < 5) {
+                return LIBNBT_ERROR_EARLY_EOF;
+            }
+            frame->type = buffer->data[buffer->pos];
+            frame->remaining = LIBNBT_LOAD32(buffer->data + buffer->pos + 1);
+            buffer->pos += 5;
+            if (frame->remaining != 0 && !isValidTag(frame->type)) {
+                return LIBNBT_ERROR_INVALID_DATA;
+            }
+            if (frame->type <= TAG_Double && frame->remaining != 0) {
+                size_t size = LIBNBT_TAG_SIZE[frame->type];
+                if ((buffer->len - buffer->pos) / size < frame->remaining) {
+                    return LIBNBT_ERROR_EARLY_EOF;
+                }
+                buffer->pos += frame->remaining * size;
+                frame->remaining = 0;
+            }
+        }
+
+        // check children until another List/Compound is met, or all frames are closed
+        while (depth > 0) {
+            frame = &stack[depth - 1];
+            if (frame->compound) {
+                if (buffer->pos >= buffer->len) {
+                    return LIBNBT_ERROR_EARLY_EOF;
+                }
+                type = buffer->data[buffer->pos];
+                if (type == TAG_End) {
+                    buffer->pos ++;
+                    depth --;
+                    continue;
+                }
+                if (!isValidTag(type)) {
+                    return LIBNBT_ERROR_INVALID_DATA;
+                }
+                if (buffer->len - buffer->pos < 3) {
+                    return LIBNBT_ERROR_EARLY_EOF;
+                }
+                size_t keylen = LIBNBT_LOAD16(buffer->data + buffer->pos + 1);
+                if (buffer->len - buffer->pos - 3 < keylen + LIBNBT_TAG_HEAD[type]) {
+                    return LIBNBT_ERROR_EARLY_EOF;
+                }
+                buffer->pos += 3 + keylen;
+            } else {
+                if (frame->remaining == 0) {
+                    depth --;
+                    continue;
+                }
+                frame->remaining --;
+                type = frame->type;
+                if (buffer->len - buffer->pos < LIBNBT_TAG_HEAD[type]) {
+                    return LIBNBT_ERROR_EARLY_EOF;
+                }
+            }
+            if (type == TAG_List || type == TAG_Compound) {
+                break;
+            }
+            int ret = LIBNBT_validate_payload(buffer, type);
+            if (ret) {
+                return ret;
+            }
+        }
+        if (depth == 0) {
+            return 0;
+        }
+    }
+}
+
+// Check the root tag, same as LIBNBT_parse_value
+int LIBNBT_validate_value(NBT_Buffer* buffer) {
+    uint8_t type;
+    uint16_t keylen;
+    if (!LIBNBT_getUint8(buffer, &type)) {
+        return LIBNBT_ERROR_EARLY_EOF;
+    }
+    if (!isValidTag(type)) {
+        return LIBNBT_ERROR_INVALID_DATA;
+    }
+    if (!LIBNBT_getUint16(buffer, &keylen) || buffer->pos + keylen > buffer->len) {
+        return LIBNBT_ERROR_EARLY_EOF;
+    }
+    buffer->pos += keylen;
+    if (type == TAG_List || type == TAG_Compound) {
+        return LIBNBT_validate_children(buffer, type);
+    }
+    if (buffer->len - buffer->pos < LIBNBT_TAG_HEAD[type]) {
+        return LIBNBT_ERROR_EARLY_EOF;
+    }
+    return LIBNBT_validate_payload(buffer, type);
+}
+
+int LIBNBT_snbt_write_space(NBT_Buffer* buffer, int spacecount) {
+    if (spacecount < 0) {
+        return 0;
+    }
+    char* buf = (char*)&buffer->data[buffer->pos];
+    int maxlen = buffer->len - buffer->pos;
+    if (maxlen <= spacecount) {
+        return LIBNBT_ERROR_BUFFER_OVERFLOW;
+    }
+    int i;
+    for (i = 0; i < spacecount; i++) {
+        buf[i] = ' ';
+    }
+    buf[i] = 0;
+    buffer->pos += spacecount;
+    return 0;
+}
+
+int LIBNBT_snbt_write_key(NBT_Buffer* buffer, char* key, int keylen) {
+    if (key && keylen > 0) {
+        BUFFER_SPRINTF(buffer, "%.*s:", keylen, key);
     }
     return 0;
 }
 
-int LIBNBT_snbt_write_number(NBT_Buffer* buffer, uint64_t value, char* key, int type) {
+int LIBNBT_snbt_write_number(NBT_Buffer* buffer, uint64_t value, char* key, int keylen, int type) {
 
-    int ret = LIBNBT_snbt_write_key(buffer, key);
+    int ret = LIBNBT_snbt_write_key(buffer, key, keylen);
     if (ret) {
         return ret;
     }
@@ -528,9 +1579,9 @@ int LIBNBT_snbt_write_number(NBT_Buffer* buffer, uint64_t value, char* key, int
     return 0;
 }
 
-int LIBNBT_snbt_write_point(NBT_Buffer* buffer, double value, char* key, int type) {
+int LIBNBT_snbt_write_point(NBT_Buffer* buffer, double value, char* key, int keylen, int type) {
 
-    int ret = LIBNBT_snbt_write_key(buffer, key);
+    int ret = LIBNBT_snbt_write_key(buffer, key, keylen);
     if (ret) {
         return ret;
     }
@@ -543,8 +1594,8 @@ int LIBNBT_snbt_write_point(NBT_Buffer* buffer, double value, char* key, int typ
     return 0;
 }
 
-int LIBNBT_snbt_write_array(NBT_Buffer* buffer, void* value, int length, char* key, int type) {
-    int ret = LIBNBT_snbt_write_key(buffer, key);
+int LIBNBT_snbt_write_array(NBT_Buffer* buffer, void* value, int length, char* key, int keylen, int type, int bigendian) {
+    int ret = LIBNBT_snbt_write_key(buffer, key, keylen);
     if (ret) {
         return ret;
     }
@@ -560,8 +1611,8 @@ int LIBNBT_snbt_write_array(NBT_Buffer* buffer, void* value, int length, char* k
     for (i = 0; i < length; i ++) {
         switch(type) {
             case TAG_Byte_Array: BUFFER_SPRINTF(buffer, "%db,", ((int8_t*)value)[i]); break;
-            case TAG_Int_Array: BUFFER_SPRINTF(buffer, "%d,", ((int32_t*)value)[i]); break;
-            case TAG_Long_Array: BUFFER_SPRINTF(buffer, "%" PRIi64 "l,", ((int64_t*)value)[i]); break;
+            case TAG_Int_Array: BUFFER_SPRINTF(buffer, "%d,", bigendian ? (int32_t)LIBNBT_LOAD32((int32_t*)value + i) : ((int32_t*)value)[i]); break;
+            case TAG_Long_Array: BUFFER_SPRINTF(buffer, "%" PRIi64 "l,", bigendian ? (int64_t)LIBNBT_LOAD64((int64_t*)value + i) : ((int64_t*)value)[i]); break;
             default: return LIBNBT_ERROR_INTERNAL;
         }
     }
@@ -579,8 +1630,8 @@ int LIBNBT_snbt_write_array(NBT_Buffer* buffer, void* value, int length, char* k
     return ret;
 }
 
-int LIBNBT_snbt_write_string(NBT_Buffer* buffer, char* value, int length, char* key) {
-    int ret = LIBNBT_snbt_write_key(buffer, key);
+int LIBNBT_snbt_write_string(NBT_Buffer* buffer, char* value, int length, char* key, int keylen) {
+    int ret = LIBNBT_snbt_write_key(buffer, key, keylen);
     if (ret) {
         return ret;
     }
@@ -614,7 +1665,7 @@ int LIBNBT_snbt_write_compound(NBT_Buffer* buffer, NBT* root, int level, int spa
         return ret;
     }
 
-    ret = LIBNBT_snbt_write_key(buffer, root->key);
+    ret = LIBNBT_snbt_write_key(buffer, root->key, LIBNBT_key_length(root));
     if (ret) {
         return ret;
     }
@@ -628,10 +1679,30 @@ int LIBNBT_snbt_write_compound(NBT_Buffer* buffer, NBT* root, int level, int spa
     if (level <= curlevel && level >= 0) {
         BUFFER_SPRINTF(buffer, "...");
     } else {
+        ret = LIBNBT_materialize(root);
+        if (ret) {
+            return ret;
+        }
         if (space >= 0) {
             BUFFER_SPRINTF(buffer, "\n");
         }
-        NBT* child = root->child;
+        NBT element;
+        int32_t i;
+        for (i = 0; (root->flags & NBT_FLAG_PACKED) && i < root->packed.len; i ++) {
+            LIBNBT_list_get(root, i, &element);
+            ret = LIBNBT_snbt_write_nbt(buffer, &element, level, space, curlevel + 1);
+            if (ret) {
+                return ret;
+            }
+            if (i == root->packed.len - 1) {
+                buffer->pos --;
+                buffer->data[buffer->pos] = 0;
+            }
+            if (space >= 0) {
+                BUFFER_SPRINTF(buffer, "\n");
+            }
+        }
+        NBT* child = (root->flags & NBT_FLAG_PACKED) ? NULL : root->child;
         while(child != NULL) {
             ret = LIBNBT_snbt_write_nbt(buffer, child, level, space, curlevel + 1);
             if (ret) {
@@ -669,7 +1740,7 @@ int LIBNBT_snbt_write_nbt(NBT_Buffer* buffer, NBT* root, int level, int space, i
         case TAG_Long:
         ret = LIBNBT_snbt_write_space(buffer, space * curlevel);
         if (ret) return ret;
-        ret = LIBNBT_snbt_write_number(buffer, root->value_i, root->key, root->type);
+        ret = LIBNBT_snbt_write_number(buffer, root->value_i, root->key, LIBNBT_key_length(root), root->type);
         if (ret) return ret;
         return 0;
 
@@ -677,7 +1748,7 @@ int LIBNBT_snbt_write_nbt(NBT_Buffer* buffer, NBT* root, int level, int space, i
         case TAG_Double:
         ret = LIBNBT_snbt_write_space(buffer, space * curlevel);
         if (ret) return ret;
-        ret = LIBNBT_snbt_write_point(buffer, root->value_d, root->key, root->type);
+        ret = LIBNBT_snbt_write_point(buffer, root->value_d, root->key, LIBNBT_key_length(root), root->type);
         if (ret) return ret;
         return 0;
 
@@ -686,14 +1757,14 @@ int LIBNBT_snbt_write_nbt(NBT_Buffer* buffer, NBT* root, int level, int space, i
         case TAG_Long_Array:
         ret = LIBNBT_snbt_write_space(buffer, space * curlevel);
         if (ret) return ret;
-        ret = LIBNBT_snbt_write_array(buffer, root->value_a.value, root->value_a.len, root->key, root->type);
+        ret = LIBNBT_snbt_write_array(buffer, root->value_a.value, root->value_a.len, root->key, LIBNBT_key_length(root), root->type, root->flags & NBT_FLAG_BIG_ENDIAN);
         if (ret) return ret;
         return 0;
 
         case TAG_String:
         ret = LIBNBT_snbt_write_space(buffer, space * curlevel);
         if (ret) return ret;
-        ret = LIBNBT_snbt_write_string(buffer, root->value_a.value, root->value_a.len, root->key);
+        ret = LIBNBT_snbt_write_string(buffer, root->value_a.value, root->value_a.len, root->key, LIBNBT_key_length(root));
         if (ret) return ret;
         return 0;
 
@@ -716,313 +1787,2412 @@ void LIBNBT_fill_err(NBT_Error* err, int errid, int position) {
     err->position = position;
 }
 
-#ifndef LIBNBT_USE_LIBDEFLATE
-
-int LIBNBT_decompress_gzip(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-
-    size_t sizestep = 1 << 16;
-    size_t sizecur = sizestep;
-    uint8_t* buffer = malloc(sizecur);
-    
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.next_in = src;
-    strm.avail_in = srcsize;
-    strm.next_out = buffer;
-    strm.avail_out = sizestep;
+void LIBNBT_context_init(NBT_Context* ctx) {
+    memset(ctx, 0, sizeof(NBT_Context));
+}
 
-    if (inflateInit2 (&strm, 15 | 32) < 0){
-        return -1; 
+// Release everything a context holds, it is empty and usable again afterwards
+void LIBNBT_context_clear(NBT_Context* ctx) {
+#ifndef LIBNBT_USE_LIBDEFLATE
+    if (ctx->ready & LIBNBT_READY_INFLATE) {
+        inflateEnd(&ctx->inflater);
     }
-    int ret;
-    while ((ret = inflate (&strm, Z_NO_FLUSH)) != Z_STREAM_END) {
-        if (ret == Z_OK) {
-            sizecur += sizestep;
-            strm.avail_out += sizestep;
-            uint8_t* newbuf = realloc(buffer, sizecur);
-            if (newbuf == NULL) {
-                free(buffer);
-                return -1;
-            }
-            strm.next_out = strm.next_out - buffer + newbuf;
-            buffer = newbuf;
-        } else {
-            return -1;
+    int i;
+    for (i = 0; i < 2; i ++) {
+        if (ctx->ready & LIBNBT_READY_DEFLATE(i)) {
+            deflateEnd(&ctx->deflater[i]);
         }
     }
-    inflateEnd (&strm);
-    *destsize = sizecur - strm.avail_out;
-    *dest = buffer;
-    return 0;
+#else
+    if (ctx->decompressor) {
+        libdeflate_free_decompressor(ctx->decompressor);
+    }
+    if (ctx->compressor) {
+        libdeflate_free_compressor(ctx->compressor);
+    }
+#endif
+    free(ctx->scratch);
+    free(ctx->staging);
+    LIBNBT_context_init(ctx);
 }
 
-int LIBNBT_decompress_zlib(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-
-    size_t sizestep = 1 << 16;
-    size_t sizecur = sizestep;
-    uint8_t* buffer = malloc(sizecur);
-    
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.next_in = src;
-    strm.avail_in = srcsize;
-    strm.next_out = buffer;
-    strm.avail_out = sizestep;
+// Grow a buffer of a context to need bytes, contents are kept
+int LIBNBT_context_grow(uint8_t** buffer, size_t* size, size_t need) {
+    if (*size >= need) {
+        return 0;
+    }
+    uint8_t* newbuf = realloc(*buffer, need);
+    if (newbuf == NULL) {
+        return -1;
+    }
+    *buffer = newbuf;
+    *size = need;
+    return 0;
+}
 
-    if (inflateInit (&strm) < 0){
-        return -1; 
+// Size of the buffer decompression starts with. Gzip data records it in the trailer (ISIZE, modulo 2^32,
+// of the last member), which is trusted when deflate could expand that much (at most 1032 times)
+size_t LIBNBT_inflate_size(NBT_Context* ctx, int compression, const uint8_t* src, size_t srcsize) {
+    if (compression == NBT_Compression_GZIP && srcsize >= 18) {
+        const uint8_t* trailer = src + srcsize - 4;
+        size_t isize = (size_t)trailer[0] | (size_t)trailer[1] << 8 | (size_t)trailer[2] << 16 | (size_t)trailer[3] << 24;
+        if (isize / 1032 <= srcsize) {
+            return isize ? isize : 1;
+        }
     }
+    size_t size = ctx->hint ? ctx->hint : srcsize * LIBNBT_INFLATE_RATIO;
+    return size < LIBNBT_INFLATE_MIN ? LIBNBT_INFLATE_MIN : size;
+}
+
+#ifndef LIBNBT_USE_LIBDEFLATE
+
+// Decompress into ctx->scratch. One stream detects both gzip and zlib headers
+int LIBNBT_decompress(NBT_Context* ctx, int compression, uint8_t* src, size_t srcsize, size_t* destsize) {
+
+    z_stream* strm = &ctx->inflater;
+
+    if (!(ctx->ready & LIBNBT_READY_INFLATE)) {
+        strm->zalloc = Z_NULL;
+        strm->zfree = Z_NULL;
+        strm->opaque = Z_NULL;
+        strm->next_in = Z_NULL;
+        strm->avail_in = 0;
+        if (inflateInit2(strm, 15 | 32) != Z_OK) {
+            return -1;
+        }
+        ctx->ready |= LIBNBT_READY_INFLATE;
+    } else if (inflateReset(strm) != Z_OK) {
+        return -1;
+    }
+    if (LIBNBT_context_grow(&ctx->scratch, &ctx->scratchsize, LIBNBT_inflate_size(ctx, compression, src, srcsize))) {
+        return -1;
+    }
+    strm->next_in = src;
+    strm->avail_in = srcsize;
+    strm->next_out = ctx->scratch;
+    strm->avail_out = ctx->scratchsize;
+
     int ret;
-    while ((ret = inflate (&strm, Z_NO_FLUSH)) != Z_STREAM_END) {
-        if (ret == Z_OK) {
-            sizecur += sizestep;
-            strm.avail_out += sizestep;
-            uint8_t* newbuf = realloc(buffer, sizecur);
-            if (newbuf == NULL) {
-                free(buffer);
+    while ((ret = inflate(strm, Z_NO_FLUSH)) != Z_STREAM_END) {
+        if (ret != Z_OK) {
+            return -1;
+        }
+        if (strm->avail_out == 0) {
+            // out of space, double it and go on where inflate stopped
+            size_t used = ctx->scratchsize;
+            if (LIBNBT_context_grow(&ctx->scratch, &ctx->scratchsize, used * 2)) {
                 return -1;
             }
-            strm.next_out = strm.next_out - buffer + newbuf;
-            buffer = newbuf;
-        } else {
-            return -1;
+            strm->next_out = ctx->scratch + used;
+            strm->avail_out = ctx->scratchsize - used;
         }
     }
-    inflateEnd (&strm);
-    *destsize = sizecur - strm.avail_out;
-    *dest = buffer;
+    *destsize = strm->next_out - ctx->scratch;
     return 0;
 }
 
-int LIBNBT_compress_gzip(uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.next_in = src;
-    strm.avail_in = srcsize;
-    strm.next_out = dest;
-    strm.avail_out = *destsize;
-
-    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY) < 0) {
+// zlib level of the NBT_LEVEL_* bits of compression. Without them, gzip uses
+// the best level and zlib the default one, same as compress()
+int LIBNBT_level(int compression) {
+    switch (compression & NBT_LEVEL_MASK) {
+        case NBT_LEVEL_FAST: return Z_BEST_SPEED;
+        case NBT_LEVEL_BALANCED: return 6;
+        case NBT_LEVEL_MAX: return Z_BEST_COMPRESSION;
+        default: break;
+    }
+    return LIBNBT_FORMAT(compression) == NBT_Compression_GZIP ? Z_BEST_COMPRESSION : 6;
+}
+
+int LIBNBT_compress(NBT_Context* ctx, int compression, uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize) {
+    int gzip = LIBNBT_FORMAT(compression) == NBT_Compression_GZIP;
+    int i = gzip ? 0 : 1;
+    int level = LIBNBT_level(compression);
+    z_stream* strm = &ctx->deflater[i];
+
+    if (!(ctx->ready & LIBNBT_READY_DEFLATE(i))) {
+        strm->zalloc = Z_NULL;
+        strm->zfree = Z_NULL;
+        strm->opaque = Z_NULL;
+        if (deflateInit2(strm, level, Z_DEFLATED, gzip ? 15 | 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        ctx->ready |= LIBNBT_READY_DEFLATE(i);
+        ctx->level[i] = level;
+    } else if (deflateReset(strm) != Z_OK) {
         return -1;
     }
-    // If return Z_OK (0), it would also need more space
-    // Refer to zlib.h, if not enough space, deflate() should be called until error encounter
-    // or when it's Z_STREAM_END (1)
-    if ( deflate(&strm, Z_FINISH) <= 0 ) {
-        deflateEnd(&strm);
+    if (ctx->level[i] != level) {
+        // nothing is pending right after a reset, so this takes effect at once
+        if (deflateParams(strm, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        ctx->level[i] = level;
+    }
+    strm->next_in = src;
+    strm->avail_in = srcsize;
+    strm->next_out = dest;
+    strm->avail_out = *destsize;
+
+    // Anything but Z_STREAM_END means the output is too small
+    if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
         return -1;
     }
-    deflateEnd(&strm);
-    *destsize = strm.total_out;
+    *destsize = strm->total_out;
     return 0;
 }
 
 #else
 
-int LIBNBT_decompress_gzip(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-    struct libdeflate_decompressor * decompressor;
-    decompressor = libdeflate_alloc_decompressor();
-    size_t sizestep = 1 << 20;
-    size_t sizecur = sizestep;
-    uint8_t* buffer = malloc(sizecur);
+// Decompress into ctx->scratch
+int LIBNBT_decompress(NBT_Context* ctx, int compression, uint8_t* src, size_t srcsize, size_t* destsize) {
+    if (ctx->decompressor == NULL) {
+        ctx->decompressor = libdeflate_alloc_decompressor();
+        if (ctx->decompressor == NULL) {
+            return -1;
+        }
+    }
+    if (LIBNBT_context_grow(&ctx->scratch, &ctx->scratchsize, LIBNBT_inflate_size(ctx, compression, src, srcsize))) {
+        return -1;
+    }
 
     enum libdeflate_result result;
-    size_t length;
-
     while(1) {
-        result = libdeflate_gzip_decompress(decompressor, src, srcsize, buffer, sizecur, &length);
+        if (compression == NBT_Compression_GZIP) {
+            result = libdeflate_gzip_decompress(ctx->decompressor, src, srcsize, ctx->scratch, ctx->scratchsize, destsize);
+        } else {
+            result = libdeflate_zlib_decompress(ctx->decompressor, src, srcsize, ctx->scratch, ctx->scratchsize, destsize);
+        }
         if (result == LIBDEFLATE_SUCCESS) {
-            libdeflate_free_decompressor(decompressor);
-            uint8_t* result = realloc(buffer, length);
-            if (result == NULL) {
-                free(buffer);
-                return -1;
-            }
-            *dest = result;
-            *destsize = length;
             return 0;
         } else if (result == LIBDEFLATE_INSUFFICIENT_SPACE) {
-            sizecur += sizestep;
-            free(buffer);
-            buffer = malloc(sizecur);
+            // libdeflate can not resume, start over with twice the space. Nothing is kept, so do not copy
+            size_t size = ctx->scratchsize * 2;
+            free(ctx->scratch);
+            ctx->scratch = NULL;
+            ctx->scratchsize = 0;
+            if (LIBNBT_context_grow(&ctx->scratch, &ctx->scratchsize, size)) {
+                return -1;
+            }
             continue;
         } else {
-            free(buffer);
-            libdeflate_free_decompressor(decompressor);
             return -1;
         }
     }
 }
 
-int LIBNBT_decompress_zlib(uint8_t** dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-    struct libdeflate_decompressor * decompressor;
-    decompressor = libdeflate_alloc_decompressor();
-    size_t sizestep = 1 << 20;
-    size_t sizecur = sizestep;
-    uint8_t* buffer = malloc(sizecur);
+// libdeflate level of the NBT_LEVEL_* bits of compression, the slowest one without them
+int LIBNBT_level(int compression) {
+    switch (compression & NBT_LEVEL_MASK) {
+        case NBT_LEVEL_FAST: return 1;
+        case NBT_LEVEL_BALANCED: return 6;
+        default: return 12;
+    }
+}
 
-    enum libdeflate_result result;
-    size_t length;
+int LIBNBT_compress(NBT_Context* ctx, int compression, uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize) {
+    int level = LIBNBT_level(compression);
+    if (ctx->compressor && ctx->level != level) {
+        // the level is fixed when a compressor is allocated
+        libdeflate_free_compressor(ctx->compressor);
+        ctx->compressor = NULL;
+    }
+    if (ctx->compressor == NULL) {
+        ctx->compressor = libdeflate_alloc_compressor(level);
+        if (ctx->compressor == NULL) {
+            return -1;
+        }
+        ctx->level = level;
+    }
 
-    while(1) {
-        result = libdeflate_zlib_decompress(decompressor, src, srcsize, buffer, sizecur, &length);
-        if (result == LIBDEFLATE_SUCCESS) {
-            libdeflate_free_decompressor(decompressor);
-            uint8_t* result = realloc(buffer, length);
-            if (result == NULL) {
-                free(buffer);
-                return -1;
+    size_t len;
+    if (LIBNBT_FORMAT(compression) == NBT_Compression_GZIP) {
+        len = libdeflate_gzip_compress(ctx->compressor, src, srcsize, dest, *destsize);
+    } else {
+        len = libdeflate_zlib_compress(ctx->compressor, src, srcsize, dest, *destsize);
+    }
+
+    if (len == 0) return -1;
+    *destsize = len;
+    return 0;
+}
+
+#endif
+
+NBT_Context* NBT_Context_Init(void) {
+    NBT_Context* ctx = malloc(sizeof(NBT_Context));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    LIBNBT_context_init(ctx);
+    return ctx;
+}
+
+void NBT_Context_SizeHint(NBT_Context* ctx, size_t size) {
+    ctx->hint = size;
+}
+
+void NBT_Context_Free(NBT_Context* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    LIBNBT_context_clear(ctx);
+    free(ctx);
+}
+
+int NBT_toSNBT_Opt(NBT* root, char* buff, size_t* bufflen, int maxlevel, int space, NBT_Error* errid) {
+    NBT_Buffer *buffer = LIBNBT_init_buffer((uint8_t*)buff, *bufflen);
+    int ret;
+    ret = LIBNBT_snbt_write_nbt(buffer, root, maxlevel, space, 0);
+    LIBNBT_fill_err(errid, ret, buffer->pos);
+    buffer->data[buffer->pos - 1] = 0;
+    *bufflen = buffer->pos;
+    return ret;
+}
+
+int NBT_toSNBT(NBT* root, char* buff, size_t* bufflen) {
+    return NBT_toSNBT_Opt(root, buff, bufflen, -1, -1, NULL);
+}
+
+// FNV-1a
+uint32_t LIBNBT_hash(const char* key, size_t keylen) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < keylen; i ++) {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Index count children of a compound, in the document arena or on the heap
+struct NBT_Index* LIBNBT_index_build(NBT* root, uint32_t count, NBT_Document* doc) {
+    uint32_t size = 4;
+    while (size < count * 2) {
+        size <<= 1;
+    }
+    struct NBT_Index* index = LIBNBT_alloc(doc, sizeof(struct NBT_Index) + sizeof(NBT_Index_Slot) * size);
+    if (index == NULL) {
+        return NULL;
+    }
+    memset(index->slots, 0, sizeof(NBT_Index_Slot) * size);
+    index->count = 0;
+    index->mask = size - 1;
+    NBT* child;
+    for (child = root->child; child; child = child->next) {
+        LIBNBT_index_insert(index, child);
+    }
+    return index;
+}
+
+// Add a child to an index with room for it
+void LIBNBT_index_insert(struct NBT_Index* index, NBT* child) {
+    if (child->key == NULL) {
+        return;
+    }
+    size_t keylen = LIBNBT_key_length(child);
+    uint32_t hash = LIBNBT_hash(child->key, keylen);
+    uint32_t i = hash & index->mask;
+    while (index->slots[i].node) {
+        NBT* node = index->slots[i].node;
+        if (index->slots[i].hash == hash && (size_t)LIBNBT_key_length(node) == keylen && !memcmp(node->key, child->key, keylen)) {
+            // duplicated key, the first one wins like the linear search
+            return;
+        }
+        i = (i + 1) & index->mask;
+    }
+    index->slots[i].hash = hash;
+    index->slots[i].node = child;
+    index->count ++;
+}
+
+NBT* LIBNBT_index_find(struct NBT_Index* index, const char* key, size_t keylen, uint32_t hash) {
+    uint32_t i = hash & index->mask;
+    while (index->slots[i].node) {
+        NBT* node = index->slots[i].node;
+        if (index->slots[i].hash == hash && (size_t)LIBNBT_key_length(node) == keylen && !memcmp(node->key, key, keylen)) {
+            return node;
+        }
+        i = (i + 1) & index->mask;
+    }
+    return NULL;
+}
+
+int NBT_EnableIndex(NBT* root) {
+    if (root == NULL || root->type != TAG_Compound) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (root->flags & NBT_FLAG_DOCUMENT) {
+        // documents index at parse time, see NBT_PARSE_INDEX
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (!(root->flags & NBT_FLAG_INDEX)) {
+        root->flags |= NBT_FLAG_INDEX;
+        root->index = NULL;
+    }
+    return 0;
+}
+
+void NBT_DropIndex(NBT* root) {
+    if (root == NULL || root->type != TAG_Compound || !(root->flags & NBT_FLAG_INDEX) || root->index == NULL) {
+        return;
+    }
+    if (!(root->flags & NBT_FLAG_DOCUMENT)) {
+        free(root->index);
+    } else {
+        // arena memory, can not be rebuilt
+        root->flags &= ~NBT_FLAG_INDEX;
+    }
+    root->index = NULL;
+}
+
+int NBT_AddChild(NBT* root, NBT* child) {
+    if (root == NULL || child == NULL || (root->type != TAG_Compound && root->type != TAG_List)) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (LIBNBT_materialize(root) || ((root->flags & NBT_FLAG_PACKED) && NBT_UnpackList(root))) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    NBT* last = root->child;
+    while (last && last->next) {
+        last = last->next;
+    }
+    child->prev = last;
+    child->next = NULL;
+    if (last) {
+        last->next = child;
+    } else {
+        root->child = child;
+    }
+    if (root->type == TAG_Compound && (root->flags & NBT_FLAG_INDEX) && root->index) {
+        struct NBT_Index* index = root->index;
+        if ((index->count + 1) * 2 <= index->mask + 1) {
+            LIBNBT_index_insert(index, child);
+        } else {
+            // full, rebuilt bigger on the next lookup
+            NBT_DropIndex(root);
+        }
+    }
+    return 0;
+}
+
+int NBT_RemoveChild(NBT* root, NBT* child) {
+    if (root == NULL || child == NULL || (root->type != TAG_Compound && root->type != TAG_List)) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (LIBNBT_materialize(root) || (root->flags & NBT_FLAG_PACKED)) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (child->prev ? child->prev->next != child : root->child != child) {
+        // not a child of root
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (child->prev) {
+        child->prev->next = child->next;
+    } else {
+        root->child = child->next;
+    }
+    if (child->next) {
+        child->next->prev = child->prev;
+    }
+    child->prev = NULL;
+    child->next = NULL;
+    // a later child with the same key may show up now, so the index is rebuilt
+    NBT_DropIndex(root);
+    return 0;
+}
+
+// Index of a compound for a lookup, (re)built if needed. NULL when it is not indexed
+struct NBT_Index* LIBNBT_get_index(NBT* root) {
+    if (!(root->flags & NBT_FLAG_INDEX)) {
+        return NULL;
+    }
+    if (root->index == NULL && !(root->flags & NBT_FLAG_DOCUMENT)) {
+        uint32_t count = 0;
+        NBT* child;
+        for (child = root->child; child; child = child->next) {
+            count ++;
+        }
+        root->index = LIBNBT_index_build(root, count, NULL);
+    }
+    return root->index;
+}
+
+NBT* NBT_GetChild(NBT* root, const char* key) {
+    if (root == NULL || root->type != TAG_Compound || LIBNBT_materialize(root) || root->child == NULL) {
+        return NULL;
+    }
+    size_t keylen = strlen(key);
+    struct NBT_Index* index = LIBNBT_get_index(root);
+    if (index) {
+        return LIBNBT_index_find(index, key, keylen, LIBNBT_hash(key, keylen));
+    }
+    NBT* child = root->child;
+    while(child) {
+        if (child->flags & NBT_FLAG_VIEW) {
+            if (child->keylen == keylen && !memcmp(child->key, key, keylen)) {
+                return child;
+            }
+        } else if (!strcmp(child->key, key)) {
+            return child;
+        }
+        child = child->next;
+    }
+    return NULL;
+}
+
+NBT* NBT_GetChild_Atom(NBT* root, const char* atom) {
+    if (root == NULL || root->type != TAG_Compound || LIBNBT_materialize(root) || root->child == NULL) {
+        return NULL;
+    }
+    if (root->flags & NBT_FLAG_INDEX) {
+        return NBT_GetChild(root, atom);
+    }
+    size_t atomlen = strlen(atom);
+    NBT* child = root->child;
+    while (child) {
+        if (child->key == atom) {
+            return child;
+        }
+        if (!(child->flags & NBT_FLAG_ATOM) && child->key && (size_t)LIBNBT_key_length(child) == atomlen
+            && !memcmp(child->key, atom, atomlen)) {
+            // a key added by hand
+            return child;
+        }
+        child = child->next;
+    }
+    return NULL;
+}
+
+NBT* NBT_GetFirstChild(NBT* root) {
+    if (root == NULL || (root->type != TAG_Compound && root->type != TAG_List)) {
+        return NULL;
+    }
+    if (LIBNBT_materialize(root) || (root->flags & NBT_FLAG_PACKED)) {
+        return NULL;
+    }
+    return root->child;
+}
+
+int32_t NBT_GetArrayInt(NBT* root, int32_t index) {
+    if (root == NULL || root->type != TAG_Int_Array || index < 0 || index >= root->value_a.len) {
+        return 0;
+    }
+    if (root->flags & NBT_FLAG_BIG_ENDIAN) {
+        return LIBNBT_LOAD32((int32_t*)root->value_a.value + index);
+    }
+    return ((int32_t*)root->value_a.value)[index];
+}
+
+int64_t NBT_GetArrayLong(NBT* root, int32_t index) {
+    if (root == NULL || root->type != TAG_Long_Array || index < 0 || index >= root->value_a.len) {
+        return 0;
+    }
+    if (root->flags & NBT_FLAG_BIG_ENDIAN) {
+        return LIBNBT_LOAD64((int64_t*)root->value_a.value + index);
+    }
+    return ((int64_t*)root->value_a.value)[index];
+}
+
+int32_t NBT_GetArrayRange(NBT* root, int32_t start, int32_t count, void* out) {
+    if (root == NULL || start < 0 || count < 0 || start > root->value_a.len) {
+        return 0;
+    }
+    if (root->type != TAG_Byte_Array && root->type != TAG_Int_Array && root->type != TAG_Long_Array) {
+        return 0;
+    }
+    if (count > root->value_a.len - start) {
+        count = root->value_a.len - start;
+    }
+    size_t size = LIBNBT_TAG_SIZE[root->type];
+    uint8_t* value = (uint8_t*)root->value_a.value + start * size;
+    if (!(root->flags & NBT_FLAG_BIG_ENDIAN)) {
+        memcpy(out, value, count * size);
+    } else if (root->type == TAG_Int_Array) {
+        LIBNBT_bswap_copy32(out, value, count);
+    } else {
+        LIBNBT_bswap_copy64(out, value, count);
+    }
+    return count;
+}
+
+// Copy element index of a list to element, as NBT_Parse would store it. Returns 0 on success
+int LIBNBT_list_get(NBT* root, int32_t index, NBT* element) {
+    if (root == NULL || root->type != TAG_List || index < 0 || LIBNBT_materialize(root)) {
+        return -1;
+    }
+    if (!(root->flags & NBT_FLAG_PACKED)) {
+        NBT* child = root->child;
+        while (child && index > 0) {
+            child = child->next;
+            index --;
+        }
+        if (child == NULL) {
+            return -1;
+        }
+        *element = *child;
+        return 0;
+    }
+    if (index >= root->packed.len) {
+        return -1;
+    }
+    memset(element, 0, sizeof(NBT));
+    element->type = root->packed.type;
+    switch (root->packed.type) {
+        case TAG_Byte:
+            element->value_i = ((uint8_t*)root->packed.value)[index];
+            break;
+        case TAG_Short:
+            element->value_i = ((uint16_t*)root->packed.value)[index];
+            break;
+        case TAG_Int:
+            element->value_i = ((uint32_t*)root->packed.value)[index];
+            break;
+        case TAG_Long:
+            element->value_i = ((int64_t*)root->packed.value)[index];
+            break;
+        case TAG_Float:
+            element->value_d = ((float*)root->packed.value)[index];
+            break;
+        case TAG_Double:
+            element->value_d = ((double*)root->packed.value)[index];
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+const void* NBT_GetListData(NBT* root, NBT_Tags* type, int32_t* len) {
+    if (root == NULL || root->type != TAG_List || LIBNBT_materialize(root) || !(root->flags & NBT_FLAG_PACKED)) {
+        return NULL;
+    }
+    if (type) {
+        *type = root->packed.type;
+    }
+    if (len) {
+        *len = root->packed.len;
+    }
+    return root->packed.value;
+}
+
+int64_t NBT_GetListInt(NBT* root, int32_t index) {
+    NBT element;
+    if (LIBNBT_list_get(root, index, &element)) {
+        return 0;
+    }
+    switch (element.type) {
+        case TAG_Byte: return (int8_t)element.value_i;
+        case TAG_Short: return (int16_t)element.value_i;
+        case TAG_Int: return (int32_t)element.value_i;
+        case TAG_Long: return element.value_i;
+        default: return 0;
+    }
+}
+
+double NBT_GetListDouble(NBT* root, int32_t index) {
+    NBT element;
+    if (LIBNBT_list_get(root, index, &element) || (element.type != TAG_Float && element.type != TAG_Double)) {
+        return 0;
+    }
+    return element.value_d;
+}
+
+int NBT_PackList(NBT* root) {
+    if (root == NULL || root->type != TAG_List || (root->flags & NBT_FLAG_DOCUMENT)) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if ((root->flags & NBT_FLAG_PACKED) || root->child == NULL) {
+        return 0;
+    }
+    uint8_t type = root->child->type;
+    if (type < TAG_Byte || type > TAG_Double) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    int32_t len = 0;
+    NBT* child;
+    for (child = root->child; child; child = child->next) {
+        if (child->type != type) {
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        len ++;
+    }
+    void* value = malloc((size_t)len * LIBNBT_TAG_SIZE[type]);
+    if (value == NULL) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    int32_t i = 0;
+    for (child = root->child; child; child = child->next, i ++) {
+        switch (type) {
+            case TAG_Byte: ((uint8_t*)value)[i] = child->value_i; break;
+            case TAG_Short: ((uint16_t*)value)[i] = child->value_i; break;
+            case TAG_Int: ((uint32_t*)value)[i] = child->value_i; break;
+            case TAG_Long: ((int64_t*)value)[i] = child->value_i; break;
+            case TAG_Float: ((float*)value)[i] = child->value_d; break;
+            case TAG_Double: ((double*)value)[i] = child->value_d; break;
+            default: break;
+        }
+    }
+    NBT_Free(root->child);
+    root->packed.value = value;
+    root->packed.len = len;
+    root->packed.type = type;
+    root->flags |= NBT_FLAG_PACKED;
+    return 0;
+}
+
+int NBT_UnpackList(NBT* root) {
+    if (root == NULL || root->type != TAG_List || (root->flags & NBT_FLAG_DOCUMENT)) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (!(root->flags & NBT_FLAG_PACKED)) {
+        return 0;
+    }
+    NBT* first = NULL;
+    NBT* last = NULL;
+    int32_t i;
+    for (i = 0; i < root->packed.len; i ++) {
+        NBT* child = LIBNBT_create_NBT(NULL, root->packed.type);
+        if (child == NULL) {
+            if (first) {
+                NBT_Free(first);
+            }
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        LIBNBT_list_get(root, i, child);
+        if (last == NULL) {
+            first = child;
+        } else {
+            last->next = child;
+            child->prev = last;
+        }
+        last = child;
+    }
+    free(root->packed.value);
+    root->flags &= ~NBT_FLAG_PACKED;
+    root->child = first;
+    root->index = NULL;
+    return 0;
+}
+
+NBT* NBT_GetChild_Deep(NBT* root, ...) {
+    va_list va;
+    va_start(va, root);
+    char* temp;
+    NBT* current = root;
+    while ((temp = va_arg(va, char*)) != NULL) {
+        current = NBT_GetChild(current, temp);
+        if (current == NULL) {
+            va_end(va);
+            return NULL;
+        }
+    }
+    va_end(va);
+    return current;
+}
+
+NBT_Path* NBT_CompilePath(const char* path) {
+    // count segments and key bytes first, everything goes in one allocation
+    const char* key;
+    size_t keylen;
+    int64_t index;
+    int count = 0;
+    size_t keysize = 0;
+    const char* cursor = path;
+    while ((cursor = LIBNBT_path_segment(cursor, &key, &keylen, &index)) != NULL) {
+        if (index == INT64_MAX) {
+            return NULL;
+        }
+        count ++;
+        keysize += keylen + 1;
+    }
+
+    NBT_Path* compiled = malloc(sizeof(NBT_Path) + sizeof(NBT_Path_Segment) * count + keysize);
+    if (compiled == NULL) {
+        return NULL;
+    }
+    compiled->count = count;
+    char* keys = (char*)(compiled->segments + count);
+    int i = 0;
+    cursor = path;
+    while ((cursor = LIBNBT_path_segment(cursor, &key, &keylen, &index)) != NULL) {
+        NBT_Path_Segment* segment = &compiled->segments[i ++];
+        segment->index = index;
+        segment->keylen = keylen;
+        segment->hash = LIBNBT_hash(key, keylen);
+        segment->key = keys;
+        if (keylen) {
+            memcpy(keys, key, keylen);
+        }
+        keys[keylen] = 0;
+        keys += keylen + 1;
+    }
+    return compiled;
+}
+
+NBT* NBT_Eval(const NBT_Path* path, NBT* root) {
+    int i;
+    for (i = 0; i < path->count && root; i ++) {
+        const NBT_Path_Segment* segment = &path->segments[i];
+        if (segment->index >= 0) {
+            if (root->type != TAG_List || LIBNBT_materialize(root) || (root->flags & NBT_FLAG_PACKED)) {
+                return NULL;
+            }
+            int64_t n = segment->index;
+            root = root->child;
+            while (root && n > 0) {
+                root = root->next;
+                n --;
+            }
+            continue;
+        }
+        if (root->type != TAG_Compound || LIBNBT_materialize(root)) {
+            return NULL;
+        }
+        struct NBT_Index* index = LIBNBT_get_index(root);
+        if (index) {
+            root = LIBNBT_index_find(index, segment->key, segment->keylen, segment->hash);
+            continue;
+        }
+        NBT* child;
+        for (child = root->child; child; child = child->next) {
+            if (child->key && child->key[0] == segment->key[0] && (size_t)LIBNBT_key_length(child) == segment->keylen
+                && !memcmp(child->key, segment->key, segment->keylen)) {
+                break;
+            }
+        }
+        root = child;
+    }
+    return root;
+}
+
+void NBT_FreePath(NBT_Path* path) {
+    free(path);
+}
+
+// Decompress data if it is gzip or zlib. *result is data itself when it is not compressed
+// Decompressed data is ctx->scratch, which belongs to the context
+int LIBNBT_uncompress(NBT_Context* ctx, uint8_t* data, size_t length, uint8_t** result, size_t* resultlen) {
+    int ret = 0;
+    if (length > 1 && data[0] == 0x1f && data[1] == 0x8b) {
+        // file is gzip
+        ret = LIBNBT_decompress(ctx, NBT_Compression_GZIP, data, length, resultlen);
+        *result = ctx->scratch;
+    } else if (length > 0 && data[0] == 0x78) {
+        // file is zlib
+        ret = LIBNBT_decompress(ctx, NBT_Compression_ZLIB, data, length, resultlen);
+        *result = ctx->scratch;
+    } else {
+        *result = data;
+        *resultlen = length;
+    }
+    if (ret != 0) {
+        return LIBNBT_ERROR_UNZIP_ERROR;
+    }
+    return 0;
+}
+
+NBT* LIBNBT_parse_data(NBT_Context* ctx, uint8_t* data, size_t length, NBT_Document* doc, NBT_Atoms* atoms, NBT_Error* errid) {
+
+    NBT_Buffer buffer;
+    size_t size;
+    uint8_t* undata;
+
+    NBT_Context local;
+    if (ctx == NULL) {
+        LIBNBT_context_init(&local);
+        ctx = &local;
+    }
+    if (LIBNBT_uncompress(ctx, data, length, &undata, &size)) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_UNZIP_ERROR, 0);
+        if (ctx == &local) {
+            LIBNBT_context_clear(&local);
+        }
+        return NULL;
+    }
+    buffer.data = undata;
+    buffer.len = size;
+    buffer.pos = 0;
+    buffer.stream = NULL;
+
+    if (doc) {
+        doc->source = LIBNBT_alloc(doc, sizeof(struct NBT_Source));
+        if (doc->source == NULL) {
+            LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+            if (ctx == &local) {
+                LIBNBT_context_clear(&local);
+            }
+            return NULL;
+        }
+        doc->source->doc = doc;
+        doc->source->data = buffer.data;
+        doc->source->len = buffer.len;
+    }
+
+    NBT* root = LIBNBT_create_NBT(doc, TAG_End);
+    int ret = LIBNBT_parse_value(root, &buffer, 0, doc, atoms);
+    if (undata != data && ret == 0 && doc && (doc->flags & (NBT_PARSE_ZEROCOPY | NBT_PARSE_LAZY))) {
+        // the tree points into the decompressed data, hand it to the document until reset.
+        // If it can not be recorded, the context keeps (and frees) it and the parse fails
+        ret = LIBNBT_document_keep(doc, undata);
+        if (ret == 0) {
+            ctx->scratch = NULL;
+            ctx->scratchsize = 0;
+        }
+    }
+    if (ctx == &local) {
+        LIBNBT_context_clear(&local);
+    }
+
+    if (ret != 0) {
+        LIBNBT_fill_err(errid, ret, buffer.pos);
+        NBT_Free(root);
+        return NULL;
+    } else {
+        if (buffer.pos != buffer.len) {
+            LIBNBT_fill_err(errid, LIBNBT_ERROR_LEFTOVER_DATA, buffer.pos);
+        } else {
+            LIBNBT_fill_err(errid, 0, buffer.pos);
+        }
+        return root;
+    }
+}
+
+NBT* NBT_Parse_Opt(uint8_t* data, size_t length, NBT_Error* errid) {
+    return LIBNBT_parse_data(NULL, data, length, NULL, NULL, errid);
+}
+
+NBT* NBT_Parse_Ctx(NBT_Context* ctx, uint8_t* data, size_t length, NBT_Error* errid) {
+    return LIBNBT_parse_data(ctx, data, length, NULL, NULL, errid);
+}
+
+NBT* NBT_Parse(uint8_t* data, size_t length) {
+    return NBT_Parse_Opt(data, length, NULL);
+}
+
+NBT* NBT_Parse_Atoms(uint8_t* data, size_t length, NBT_Atoms* atoms, NBT_Error* errid) {
+    return LIBNBT_parse_data(NULL, data, length, NULL, atoms, errid);
+}
+
+int NBT_Validate_Ctx(NBT_Context* ctx, uint8_t* data, size_t length, NBT_Error* errid) {
+    uint8_t* undata;
+    size_t size;
+    NBT_Context local;
+    if (ctx == NULL) {
+        LIBNBT_context_init(&local);
+        ctx = &local;
+    }
+    if (LIBNBT_uncompress(ctx, data, length, &undata, &size)) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_UNZIP_ERROR, 0);
+        if (ctx == &local) {
+            LIBNBT_context_clear(&local);
+        }
+        return LIBNBT_ERROR_UNZIP_ERROR;
+    }
+
+    NBT_Buffer buffer;
+    buffer.data = undata;
+    buffer.len = size;
+    buffer.pos = 0;
+
+    int ret = LIBNBT_validate_value(&buffer);
+    if (ret == 0 && buffer.pos != buffer.len) {
+        ret = LIBNBT_ERROR_LEFTOVER_DATA;
+    }
+    LIBNBT_fill_err(errid, ret, buffer.pos);
+
+    if (ctx == &local) {
+        LIBNBT_context_clear(&local);
+    }
+    return ret;
+}
+
+int NBT_Validate(uint8_t* data, size_t length, NBT_Error* errid) {
+    return NBT_Validate_Ctx(NULL, data, length, errid);
+}
+
+NBT_Atoms* NBT_Atoms_Init(void) {
+    NBT_Atoms* atoms = malloc(sizeof(NBT_Atoms));
+    if (atoms == NULL) {
+        return NULL;
+    }
+    atoms->strings = NBT_Document_Init();
+    atoms->slots = calloc(LIBNBT_ATOMS_SLOTS, sizeof(NBT_Atom_Slot));
+    if (atoms->strings == NULL || atoms->slots == NULL) {
+        NBT_Atoms_Free(atoms);
+        return NULL;
+    }
+    atoms->mask = LIBNBT_ATOMS_SLOTS - 1;
+    atoms->count = 0;
+    return atoms;
+}
+
+void NBT_Atoms_Free(NBT_Atoms* atoms) {
+    if (atoms == NULL) {
+        return;
+    }
+    if (atoms->strings) {
+        NBT_Document_Free(atoms->strings);
+    }
+    free(atoms->slots);
+    free(atoms);
+}
+
+// Find or add a key, returns its '\0' ended atom
+char* LIBNBT_intern(NBT_Atoms* atoms, const char* key, size_t keylen) {
+    uint32_t hash = LIBNBT_hash(key, keylen);
+    uint32_t i = hash & atoms->mask;
+    while (atoms->slots[i].str) {
+        if (atoms->slots[i].hash == hash && atoms->slots[i].len == keylen && !memcmp(atoms->slots[i].str, key, keylen)) {
+            return atoms->slots[i].str;
+        }
+        i = (i + 1) & atoms->mask;
+    }
+
+    if ((atoms->count + 1) * 2 > atoms->mask + 1) {
+        // keep the table at most half full
+        uint32_t size = (atoms->mask + 1) * 2;
+        NBT_Atom_Slot* slots = calloc(size, sizeof(NBT_Atom_Slot));
+        if (slots == NULL) {
+            return NULL;
+        }
+        uint32_t j;
+        for (j = 0; j <= atoms->mask; j ++) {
+            if (atoms->slots[j].str) {
+                uint32_t k = atoms->slots[j].hash & (size - 1);
+                while (slots[k].str) {
+                    k = (k + 1) & (size - 1);
+                }
+                slots[k] = atoms->slots[j];
+            }
+        }
+        free(atoms->slots);
+        atoms->slots = slots;
+        atoms->mask = size - 1;
+        i = hash & atoms->mask;
+        while (atoms->slots[i].str) {
+            i = (i + 1) & atoms->mask;
+        }
+    }
+
+    char* str = LIBNBT_alloc(atoms->strings, keylen + 1);
+    if (str == NULL) {
+        return NULL;
+    }
+    memcpy(str, key, keylen);
+    str[keylen] = 0;
+    atoms->slots[i].hash = hash;
+    atoms->slots[i].len = keylen;
+    atoms->slots[i].str = str;
+    atoms->count ++;
+    return str;
+}
+
+const char* NBT_Atoms_Intern(NBT_Atoms* atoms, const char* key) {
+    return LIBNBT_intern(atoms, key, strlen(key));
+}
+
+void NBT_Document_SetAtoms(NBT_Document* doc, NBT_Atoms* atoms) {
+    doc->atoms = atoms;
+}
+
+int LIBNBT_document_keep(NBT_Document* doc, uint8_t* data) {
+    NBT_Kept_Buffer* kept = LIBNBT_alloc(doc, sizeof(NBT_Kept_Buffer));
+    if (kept == NULL) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    kept->data = data;
+    kept->next = doc->kept;
+    doc->kept = kept;
+    return 0;
+}
+
+void LIBNBT_document_release(NBT_Document* doc) {
+    NBT_Kept_Buffer* kept = doc->kept;
+    while (kept) {
+        free(kept->data);
+        kept = kept->next;
+    }
+    doc->kept = NULL;
+}
+
+NBT_Document* NBT_Document_Init_Opt(int flags) {
+    NBT_Document* doc = malloc(sizeof(NBT_Document));
+    if (doc == NULL) {
+        return NULL;
+    }
+    doc->head = LIBNBT_arena_block(LIBNBT_ARENA_BLOCK);
+    if (doc->head == NULL) {
+        free(doc);
+        return NULL;
+    }
+    doc->current = doc->head;
+    doc->flags = flags;
+    doc->kept = NULL;
+    doc->source = NULL;
+    doc->atoms = NULL;
+    return doc;
+}
+
+NBT_Document* NBT_Document_Init(void) {
+    return NBT_Document_Init_Opt(0);
+}
+
+NBT* NBT_Parse_Document(NBT_Document* doc, uint8_t* data, size_t length, NBT_Error* errid) {
+    return NBT_Parse_Document_Ctx(NULL, doc, data, length, errid);
+}
+
+NBT* NBT_Parse_Document_Ctx(NBT_Context* ctx, NBT_Document* doc, uint8_t* data, size_t length, NBT_Error* errid) {
+    if (doc == NULL) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        return NULL;
+    }
+    return LIBNBT_parse_data(ctx, data, length, doc, doc->atoms, errid);
+}
+
+void NBT_Document_Reset(NBT_Document* doc) {
+    LIBNBT_document_release(doc);
+    NBT_Arena_Block* block = doc->head;
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+    // The last tree needed several blocks, merge them so the next one fits in a single block
+    size_t total = 0;
+    for (; block; block = block->next) {
+        total += block->size;
+    }
+    NBT_Arena_Block* merged = LIBNBT_arena_block(total);
+    // Without memory for the merged block, keep the first one
+    block = merged ? doc->head : doc->head->next;
+    while (block) {
+        NBT_Arena_Block* next = block->next;
+        free(block);
+        block = next;
+    }
+    if (merged) {
+        doc->head = merged;
+    } else {
+        doc->head->next = NULL;
+        doc->head->used = 0;
+    }
+    doc->current = doc->head;
+}
+
+void NBT_Document_Free(NBT_Document* doc) {
+    LIBNBT_document_release(doc);
+    NBT_Arena_Block* block = doc->head;
+    while (block) {
+        NBT_Arena_Block* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(doc);
+}
+
+// Split the next segment of a path: a key up to '.' or '[', or an index "[n]".
+// Returns the rest of the path, or NULL if there is no segment left
+const char* LIBNBT_path_segment(const char* path, const char** key, size_t* keylen, int64_t* index) {
+    if (path == NULL || path[0] == 0) {
+        return NULL;
+    }
+    if (path[0] == '[') {
+        char* end;
+        *index = strtoll(path + 1, &end, 10);
+        if (end == path + 1 || *end != ']' || *index < 0) {
+            // malformed index never matches
+            *index = INT64_MAX;
+            end = strchr(path, ']');
+            if (end == NULL) {
+                end = (char*)path + strlen(path) - 1;
+            }
+        }
+        *key = NULL;
+        *keylen = 0;
+        path = end + 1;
+    } else {
+        size_t len = strcspn(path, ".[");
+        *key = path;
+        *keylen = len;
+        *index = -1;
+        path += len;
+    }
+    if (path[0] == '.') {
+        path ++;
+    }
+    return path;
+}
+
+// Store the value of a tag spanning from start to the buffer position.
+// Array/String/List/Compound values point into the buffer when it outlives the scan
+int LIBNBT_extract_fill(NBT_Buffer* buffer, size_t start, uint8_t type, NBT_Value* out, int alive) {
+    NBT_Buffer value;
+    value.data = buffer->data;
+    value.len = buffer->pos;
+    value.pos = start;
+    out->type = type;
+    out->offset = start;
+    int ok = 1;
+    switch (type) {
+        case TAG_Byte: {
+            uint8_t v = 0;
+            ok = LIBNBT_getUint8(&value, &v);
+            out->value_i = (int8_t)v;
+            break;
+        }
+        case TAG_Short: {
+            uint16_t v = 0;
+            ok = LIBNBT_getUint16(&value, &v);
+            out->value_i = (int16_t)v;
+            break;
+        }
+        case TAG_Int: {
+            uint32_t v = 0;
+            ok = LIBNBT_getUint32(&value, &v);
+            out->value_i = (int32_t)v;
+            break;
+        }
+        case TAG_Long: {
+            uint64_t v = 0;
+            ok = LIBNBT_getUint64(&value, &v);
+            out->value_i = (int64_t)v;
+            break;
+        }
+        case TAG_Float: {
+            float v = 0;
+            ok = LIBNBT_getFloat(&value, &v);
+            out->value_d = v;
+            break;
+        }
+        case TAG_Double: {
+            double v = 0;
+            ok = LIBNBT_getDouble(&value, &v);
+            out->value_d = v;
+            break;
+        }
+        case TAG_String: {
+            uint16_t len = 0;
+            ok = LIBNBT_getUint16(&value, &len);
+            out->offset = value.pos;
+            out->value_a.len = len + 1;
+            break;
+        }
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array: {
+            uint32_t len = 0;
+            ok = LIBNBT_getUint32(&value, &len);
+            out->offset = value.pos;
+            out->value_a.len = len;
+            break;
+        }
+        default:
+            // List and Compound: the raw payload
+            out->value_a.len = buffer->pos - start;
+            break;
+    }
+    if (!ok) {
+        // the tag was skipped already, so this means a bug
+        out->type = TAG_End;
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (type >= TAG_Byte_Array) {
+        out->value_a.value = alive ? buffer->data + out->offset : NULL;
+    }
+    return 0;
+}
+
+// Match the paths active at depth against a child tag.
+// Returns how many paths need to descend into the child
+int LIBNBT_extract_match(NBT_Extract_State* state, int depth, const char* key, size_t keylen, int64_t index) {
+    int i;
+    int descend = 0;
+    for (i = 0; i < state->count; i ++) {
+        if (state->depth[i] != depth) {
+            continue;
+        }
+        const char* segkey;
+        size_t segkeylen;
+        int64_t segindex;
+        const char* rest = LIBNBT_path_segment(state->cursor[i], &segkey, &segkeylen, &segindex);
+        if (segindex != index || segkeylen != keylen || (keylen && memcmp(segkey, key, keylen))) {
+            continue;
+        }
+        if (rest[0] == 0) {
+            state->depth[i] = LIBNBT_EXTRACT_PENDING(depth);
+        } else {
+            state->cursor[i] = rest;
+            state->depth[i] = depth + 1;
+            descend ++;
+        }
+    }
+    return descend;
+}
+
+// Scan the payload of a List/Compound at the given depth
+int LIBNBT_extract_walk(NBT_Buffer* buffer, NBT_Extract_State* state, uint8_t type, int depth) {
+    if (depth > LIBNBT_MAX_DEPTH) {
+        return LIBNBT_ERROR_INVALID_DATA;
+    }
+    uint32_t count = 0;
+    uint8_t childtype = TAG_End;
+    if (type == TAG_List) {
+        if (!LIBNBT_getUint8(buffer, &childtype) || !LIBNBT_getUint32(buffer, &count)) {
+            return LIBNBT_ERROR_EARLY_EOF;
+        }
+        if (count && !isValidTag(childtype)) {
+            return LIBNBT_ERROR_INVALID_DATA;
+        }
+    }
+    uint32_t i;
+    for (i = 0; type == TAG_Compound || i < count; i ++) {
+        const char* key = NULL;
+        uint16_t keylen = 0;
+        if (type == TAG_Compound) {
+            if (!LIBNBT_getUint8(buffer, &childtype)) {
+                return LIBNBT_ERROR_EARLY_EOF;
+            }
+            if (childtype == TAG_End) {
+                break;
+            }
+            if (!isValidTag(childtype)) {
+                return LIBNBT_ERROR_INVALID_DATA;
+            }
+            if (!LIBNBT_getUint16(buffer, &keylen) || buffer->pos + keylen > buffer->len) {
+                return LIBNBT_ERROR_EARLY_EOF;
+            }
+            key = (const char*)buffer->data + buffer->pos;
+            buffer->pos += keylen;
+        }
+        size_t start = buffer->pos;
+        int descend = LIBNBT_extract_match(state, depth, key, keylen, type == TAG_List ? (int64_t)i : -1);
+        int ret;
+        if (descend && (childtype == TAG_List || childtype == TAG_Compound)) {
+            ret = LIBNBT_extract_walk(buffer, state, childtype, depth + 1);
+        } else {
+            ret = LIBNBT_skip_value(buffer, childtype, depth + 1);
+        }
+        if (ret) {
+            return ret;
+        }
+        int j;
+        for (j = 0; j < state->count; j ++) {
+            if (state->depth[j] == depth + 1) {
+                // went into the child but was not found there
+                state->depth[j] = -1;
+            } else if (state->depth[j] == LIBNBT_EXTRACT_PENDING(depth)) {
+                ret = LIBNBT_extract_fill(buffer, start, childtype, &state->out[j], state->alive);
+                if (ret) {
+                    return ret;
+                }
+                state->depth[j] = -1;
+                state->remaining --;
+            }
+        }
+        if (state->remaining == 0) {
+            return LIBNBT_EXTRACT_DONE;
+        }
+    }
+    return 0;
+}
+
+int NBT_Extract(uint8_t* data, size_t length, const char** paths, int count, NBT_Value* out, NBT_Error* errid) {
+    return NBT_Extract_Ctx(NULL, data, length, paths, count, out, errid);
+}
+
+// Without a context, the decompressed data is freed before returning, so only numbers and offsets are valid for compressed data
+int NBT_Extract_Ctx(NBT_Context* ctx, uint8_t* data, size_t length, const char** paths, int count, NBT_Value* out, NBT_Error* errid) {
+    uint8_t* undata;
+    size_t size;
+    NBT_Context local;
+    int alive = ctx != NULL;
+    if (ctx == NULL) {
+        LIBNBT_context_init(&local);
+        ctx = &local;
+    }
+    if (LIBNBT_uncompress(ctx, data, length, &undata, &size)) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_UNZIP_ERROR, 0);
+        if (ctx == &local) {
+            LIBNBT_context_clear(&local);
+        }
+        return LIBNBT_ERROR_UNZIP_ERROR;
+    }
+
+    NBT_Buffer buffer;
+    buffer.data = undata;
+    buffer.len = size;
+    buffer.pos = 0;
+
+    NBT_Extract_State state;
+    state.cursor = malloc(sizeof(const char*) * count);
+    state.depth = malloc(sizeof(int) * count);
+    if (count > 0 && (state.cursor == NULL || state.depth == NULL)) {
+        free(state.cursor);
+        free(state.depth);
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        if (ctx == &local) {
+            LIBNBT_context_clear(&local);
+        }
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    state.out = out;
+    state.count = count;
+    state.remaining = count;
+    state.alive = alive || undata == data;
+
+    int i;
+    for (i = 0; i < count; i ++) {
+        state.cursor[i] = paths[i];
+        state.depth[i] = 0;
+        out[i].type = TAG_End;
+    }
+
+    // the root tag, an empty path refers to it
+    uint8_t type;
+    uint16_t keylen;
+    int ret = 0;
+    if (!LIBNBT_getUint8(&buffer, &type) || !LIBNBT_getUint16(&buffer, &keylen) || buffer.pos + keylen > buffer.len) {
+        ret = LIBNBT_ERROR_EARLY_EOF;
+    } else if (!isValidTag(type)) {
+        ret = LIBNBT_ERROR_INVALID_DATA;
+    } else {
+        buffer.pos += keylen;
+        size_t start = buffer.pos;
+        int root = 0;
+        for (i = 0; i < count; i ++) {
+            if (paths[i] == NULL || paths[i][0] == 0) {
+                state.depth[i] = -1;
+                root = 1;
+            }
+        }
+        if (type == TAG_List || type == TAG_Compound) {
+            ret = LIBNBT_extract_walk(&buffer, &state, type, 0);
+        }
+        if (ret == 0 && root) {
+            if (type != TAG_List && type != TAG_Compound) {
+                ret = LIBNBT_skip_value(&buffer, type, 0);
+            }
+            for (i = 0; ret == 0 && i < count; i ++) {
+                if (paths[i] == NULL || paths[i][0] == 0) {
+                    ret = LIBNBT_extract_fill(&buffer, start, type, &out[i], state.alive);
+                }
+            }
+        }
+        if (ret == LIBNBT_EXTRACT_DONE) {
+            ret = 0;
+        }
+    }
+    LIBNBT_fill_err(errid, ret, buffer.pos);
+
+    free(state.cursor);
+    free(state.depth);
+    if (ctx == &local) {
+        LIBNBT_context_clear(&local);
+    }
+    return ret;
+}
+
+// Emit the events of a payload. Returns 0, an error, or NBT_VISIT_STOP
+int LIBNBT_visit_value(NBT_Buffer* buffer, const NBT_Visitor* visitor, void* user, uint8_t type, int depth) {
+    if (depth > LIBNBT_MAX_DEPTH) {
+        return LIBNBT_ERROR_INVALID_DATA;
+    }
+    int ret;
+    if (type != TAG_List && type != TAG_Compound) {
+        size_t start = buffer->pos;
+        ret = LIBNBT_skip_value(buffer, type, depth);
+        if (ret || visitor->value == NULL) {
+            return ret;
+        }
+        NBT_Value value;
+        ret = LIBNBT_extract_fill(buffer, start, type, &value, 1);
+        if (ret) {
+            return ret;
+        }
+        ret = visitor->value(user, &value);
+        return ret == NBT_VISIT_STOP ? NBT_VISIT_STOP : 0;
+    }
+
+    if (type == TAG_List) {
+        size_t start = buffer->pos;
+        uint8_t listtype;
+        uint32_t len;
+        if (!LIBNBT_getUint8(buffer, &listtype) || !LIBNBT_getUint32(buffer, &len)) {
+            return LIBNBT_ERROR_EARLY_EOF;
+        }
+        if (len && !isValidTag(listtype)) {
+            return LIBNBT_ERROR_INVALID_DATA;
+        }
+        ret = visitor->begin_list ? visitor->begin_list(user, listtype, len) : 0;
+        if (ret == NBT_VISIT_STOP) {
+            return ret;
+        }
+        if (ret == NBT_VISIT_SKIP) {
+            buffer->pos = start;
+            return LIBNBT_skip_value(buffer, type, depth);
+        }
+        uint32_t i;
+        for (i = 0; i < len; i ++) {
+            ret = LIBNBT_visit_value(buffer, visitor, user, listtype, depth + 1);
+            if (ret) {
+                return ret;
+            }
+        }
+        ret = visitor->end_list ? visitor->end_list(user) : 0;
+        return ret == NBT_VISIT_STOP ? NBT_VISIT_STOP : 0;
+    }
+
+    ret = visitor->begin_compound ? visitor->begin_compound(user) : 0;
+    if (ret == NBT_VISIT_STOP) {
+        return ret;
+    }
+    if (ret == NBT_VISIT_SKIP) {
+        return LIBNBT_skip_value(buffer, type, depth);
+    }
+    while (1) {
+        uint8_t childtype;
+        uint16_t keylen;
+        if (!LIBNBT_getUint8(buffer, &childtype)) {
+            return LIBNBT_ERROR_EARLY_EOF;
+        }
+        if (childtype == TAG_End) {
+            break;
+        }
+        if (!isValidTag(childtype)) {
+            return LIBNBT_ERROR_INVALID_DATA;
+        }
+        if (!LIBNBT_getUint16(buffer, &keylen) || buffer->pos + keylen > buffer->len) {
+            return LIBNBT_ERROR_EARLY_EOF;
+        }
+        const char* key = (const char*)buffer->data + buffer->pos;
+        buffer->pos += keylen;
+        ret = visitor->key ? visitor->key(user, key, keylen, childtype) : 0;
+        if (ret == NBT_VISIT_STOP) {
+            return ret;
+        }
+        if (ret == NBT_VISIT_SKIP) {
+            ret = LIBNBT_skip_value(buffer, childtype, depth + 1);
+        } else {
+            ret = LIBNBT_visit_value(buffer, visitor, user, childtype, depth + 1);
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+    ret = visitor->end_compound ? visitor->end_compound(user) : 0;
+    return ret == NBT_VISIT_STOP ? NBT_VISIT_STOP : 0;
+}
+
+int NBT_ParseEvents(uint8_t* data, size_t length, const NBT_Visitor* visitor, void* user, NBT_Error* errid) {
+    uint8_t* undata;
+    size_t size;
+    NBT_Context ctx;
+    LIBNBT_context_init(&ctx);
+    if (LIBNBT_uncompress(&ctx, data, length, &undata, &size)) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_UNZIP_ERROR, 0);
+        LIBNBT_context_clear(&ctx);
+        return LIBNBT_ERROR_UNZIP_ERROR;
+    }
+
+    NBT_Buffer buffer;
+    buffer.data = undata;
+    buffer.len = size;
+    buffer.pos = 0;
+
+    int ret = 0;
+    uint8_t type;
+    uint16_t keylen;
+    if (!LIBNBT_getUint8(&buffer, &type) || !LIBNBT_getUint16(&buffer, &keylen) || buffer.pos + keylen > buffer.len) {
+        ret = LIBNBT_ERROR_EARLY_EOF;
+    } else if (!isValidTag(type)) {
+        ret = LIBNBT_ERROR_INVALID_DATA;
+    } else {
+        const char* key = (const char*)buffer.data + buffer.pos;
+        buffer.pos += keylen;
+        ret = visitor->key ? visitor->key(user, key, keylen, type) : 0;
+        if (ret == NBT_VISIT_SKIP) {
+            ret = LIBNBT_skip_value(&buffer, type, 0);
+        } else if (ret != NBT_VISIT_STOP) {
+            ret = LIBNBT_visit_value(&buffer, visitor, user, type, 0);
+        }
+        if (ret == NBT_VISIT_STOP) {
+            ret = 0;
+        } else if (ret == 0 && buffer.pos != buffer.len) {
+            ret = LIBNBT_ERROR_LEFTOVER_DATA;
+        }
+    }
+    LIBNBT_fill_err(errid, ret, buffer.pos);
+
+    LIBNBT_context_clear(&ctx);
+    return ret;
+}
+
+NBT_Flat* LIBNBT_flat_init(void) {
+    NBT_Flat* flat = malloc(sizeof(NBT_Flat));
+    if (flat == NULL) {
+        return NULL;
+    }
+    flat->count = 0;
+    flat->nodesize = 64;
+    flat->nodes = malloc(flat->nodesize * sizeof(NBT_Flat_Node));
+    // data starts with the empty string keyless nodes point to
+    flat->datalen = 1;
+    flat->datasize = 1024;
+    flat->data = malloc(flat->datasize);
+    if (flat->nodes == NULL || flat->data == NULL) {
+        NBT_Flat_Free(flat);
+        return NULL;
+    }
+    flat->data[0] = 0;
+    return flat;
+}
+
+// Append a node, end is left for the caller when it has children
+NBT_Flat_Node* LIBNBT_flat_node(NBT_Flat* flat, uint8_t type) {
+    if (flat->count == flat->nodesize) {
+        if (flat->nodesize > UINT32_MAX / 2) {
+            return NULL;
+        }
+        NBT_Flat_Node* nodes = realloc(flat->nodes, (size_t)flat->nodesize * 2 * sizeof(NBT_Flat_Node));
+        if (nodes == NULL) {
+            return NULL;
+        }
+        flat->nodes = nodes;
+        flat->nodesize *= 2;
+    }
+    NBT_Flat_Node* node = &flat->nodes[flat->count];
+    memset(node, 0, sizeof(NBT_Flat_Node));
+    node->type = type;
+    flat->count ++;
+    node->end = flat->count;
+    return node;
+}
+
+// Reserve len bytes of data, aligned to align (a power of 2)
+int LIBNBT_flat_data(NBT_Flat* flat, size_t len, size_t align, uint32_t* offset) {
+    size_t start = (flat->datalen + align - 1) & ~(align - 1);
+    if (len > UINT32_MAX - start) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (start + len > flat->datasize) {
+        size_t size = flat->datasize;
+        while (size < start + len) {
+            size *= 2;
+        }
+        if (size > UINT32_MAX) {
+            size = UINT32_MAX;
+        }
+        uint8_t* data = realloc(flat->data, size);
+        if (data == NULL) {
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        flat->data = data;
+        flat->datasize = size;
+    }
+    memset(flat->data + flat->datalen, 0, start - flat->datalen);
+    flat->datalen = start + len;
+    *offset = start;
+    return 0;
+}
+
+int LIBNBT_flat_key(NBT_Flat* flat, const char* key, size_t keylen, uint32_t* offset) {
+    int ret = LIBNBT_flat_data(flat, keylen + 1, 1, offset);
+    if (ret) {
+        return ret;
+    }
+    if (keylen) {
+        memcpy(flat->data + *offset, key, keylen);
+    }
+    flat->data[*offset + keylen] = 0;
+    return 0;
+}
+
+// Store the string or array of a node. len is the string length or element count
+int LIBNBT_flat_payload(NBT_Flat* flat, uint32_t node, const void* value, int32_t len, int bigendian) {
+    uint8_t type = flat->nodes[node].type;
+    size_t size = type == TAG_String ? (size_t)len + 1 : (size_t)len * LIBNBT_TAG_SIZE[type];
+    uint32_t offset;
+    int ret = LIBNBT_flat_data(flat, size, type == TAG_String ? 1 : 8, &offset);
+    if (ret) {
+        return ret;
+    }
+    flat->nodes[node].len = len;
+    flat->nodes[node].offset = offset;
+    uint8_t* dest = flat->data + offset;
+    if (type == TAG_String) {
+        dest[len] = 0;
+        size = len;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (bigendian && type == TAG_Int_Array) {
+        LIBNBT_bswap_copy32(dest, value, len);
+    } else if (bigendian && type == TAG_Long_Array) {
+        LIBNBT_bswap_copy64(dest, value, len);
+    } else {
+        memcpy(dest, value, size);
+    }
+    return 0;
+}
+
+// Append root and its subtree in pre-order
+int LIBNBT_flat_from_tree(NBT_Flat* flat, NBT* root, int haskey) {
+    uint32_t i = flat->count;
+    int ret;
+    if (LIBNBT_flat_node(flat, root->type) == NULL) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    if (haskey && root->key != NULL) {
+        int keylen = LIBNBT_key_length(root);
+        uint32_t key;
+        ret = LIBNBT_flat_key(flat, root->key, keylen, &key);
+        if (ret) {
+            return ret;
+        }
+        flat->nodes[i].key = key;
+        flat->nodes[i].keylen = keylen;
+    }
+    switch (root->type) {
+        case TAG_Byte:
+            flat->nodes[i].value_i = (int8_t)root->value_i;
+            break;
+        case TAG_Short:
+            flat->nodes[i].value_i = (int16_t)root->value_i;
+            break;
+        case TAG_Int:
+            flat->nodes[i].value_i = (int32_t)root->value_i;
+            break;
+        case TAG_Long:
+            flat->nodes[i].value_i = root->value_i;
+            break;
+        case TAG_Float:
+        case TAG_Double:
+            flat->nodes[i].value_d = root->value_d;
+            break;
+        case TAG_String:
+            return LIBNBT_flat_payload(flat, i, root->value_a.value, root->value_a.len > 0 ? root->value_a.len - 1 : 0, 0);
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array:
+            return LIBNBT_flat_payload(flat, i, root->value_a.value, root->value_a.len, root->flags & NBT_FLAG_BIG_ENDIAN);
+        case TAG_List:
+        case TAG_Compound: {
+            ret = LIBNBT_materialize(root);
+            if (ret) {
+                return ret;
+            }
+            if (root->flags & NBT_FLAG_PACKED) {
+                NBT element;
+                int32_t j;
+                flat->nodes[i].listtype = root->packed.type;
+                for (j = 0; j < root->packed.len; j ++) {
+                    LIBNBT_list_get(root, j, &element);
+                    ret = LIBNBT_flat_from_tree(flat, &element, 0);
+                    if (ret) {
+                        return ret;
+                    }
+                }
+                flat->nodes[i].len = root->packed.len;
+                flat->nodes[i].end = flat->count;
+                break;
+            }
+            NBT* child = root->child;
+            if (root->type == TAG_List && child != NULL) {
+                flat->nodes[i].listtype = child->type;
+            }
+            for (; child != NULL; child = child->next) {
+                ret = LIBNBT_flat_from_tree(flat, child, root->type == TAG_Compound);
+                if (ret) {
+                    return ret;
+                }
+                flat->nodes[i].len ++;
+            }
+            flat->nodes[i].end = flat->count;
+            break;
+        }
+        default:
+            return LIBNBT_ERROR_INTERNAL;
+    }
+    return 0;
+}
+
+// Build a heap node (and its subtree) of node i
+NBT* LIBNBT_flat_to_tree(const NBT_Flat* flat, uint32_t i) {
+    const NBT_Flat_Node* node = &flat->nodes[i];
+    NBT* root = LIBNBT_create_NBT(NULL, node->type);
+    if (root == NULL) {
+        return NULL;
+    }
+    if (node->key) {
+        root->key = malloc(node->keylen + 1);
+        if (root->key == NULL) {
+            NBT_Free(root);
+            return NULL;
+        }
+        memcpy(root->key, flat->data + node->key, node->keylen + 1);
+    }
+    switch (node->type) {
+        // zero extended, same as NBT_Parse
+        case TAG_Byte:
+            root->value_i = (uint8_t)node->value_i;
+            break;
+        case TAG_Short:
+            root->value_i = (uint16_t)node->value_i;
+            break;
+        case TAG_Int:
+            root->value_i = (uint32_t)node->value_i;
+            break;
+        case TAG_Long:
+            root->value_i = node->value_i;
+            break;
+        case TAG_Float:
+        case TAG_Double:
+            root->value_d = node->value_d;
+            break;
+        case TAG_String:
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array: {
+            size_t size = node->type == TAG_String ? (size_t)node->len + 1 : (size_t)node->len * LIBNBT_TAG_SIZE[node->type];
+            root->value_a.len = node->type == TAG_String ? node->len + 1 : node->len;
+            if (size) {
+                root->value_a.value = malloc(size);
+                if (root->value_a.value == NULL) {
+                    NBT_Free(root);
+                    return NULL;
+                }
+                memcpy(root->value_a.value, flat->data + node->offset, size);
+            }
+            break;
+        }
+        case TAG_List:
+        case TAG_Compound: {
+            NBT* last = NULL;
+            uint32_t j;
+            for (j = i + 1; j < node->end; j = flat->nodes[j].end) {
+                NBT* child = LIBNBT_flat_to_tree(flat, j);
+                if (child == NULL) {
+                    NBT_Free(root);
+                    return NULL;
+                }
+                if (last == NULL) {
+                    root->child = child;
+                } else {
+                    last->next = child;
+                    child->prev = last;
+                }
+                last = child;
+            }
+            break;
+        }
+        default: break;
+    }
+    return root;
+}
+
+// Append a node to the innermost open List/Compound, with the pending key
+NBT_Flat_Node* LIBNBT_flat_add(NBT_Flat_Builder* b, uint8_t type) {
+    NBT_Flat_Node* node = LIBNBT_flat_node(b->flat, type);
+    if (node == NULL) {
+        b->error = LIBNBT_ERROR_INTERNAL;
+        return NULL;
+    }
+    node->key = b->key;
+    node->keylen = b->keylen;
+    b->key = 0;
+    b->keylen = 0;
+    if (b->depth) {
+        b->flat->nodes[b->open[b->depth - 1]].len ++;
+    }
+    return node;
+}
+
+int LIBNBT_flat_on_key(void* user, const char* key, int keylen, NBT_Tags type) {
+    NBT_Flat_Builder* b = user;
+    (void)type;
+    if (keylen == 0) {
+        // no key, like NBT_Parse
+        b->key = 0;
+        b->keylen = 0;
+        return NBT_VISIT_CONTINUE;
+    }
+    b->error = LIBNBT_flat_key(b->flat, key, keylen, &b->key);
+    b->keylen = keylen;
+    return b->error ? NBT_VISIT_STOP : NBT_VISIT_CONTINUE;
+}
+
+int LIBNBT_flat_on_value(void* user, const NBT_Value* value) {
+    NBT_Flat_Builder* b = user;
+    NBT_Flat_Node* node = LIBNBT_flat_add(b, value->type);
+    if (node == NULL) {
+        return NBT_VISIT_STOP;
+    }
+    switch (value->type) {
+        case TAG_Float:
+        case TAG_Double:
+            node->value_d = value->value_d;
+            break;
+        case TAG_String:
+            b->error = LIBNBT_flat_payload(b->flat, b->flat->count - 1, value->value_a.value, value->value_a.len - 1, 1);
+            break;
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array:
+            b->error = LIBNBT_flat_payload(b->flat, b->flat->count - 1, value->value_a.value, value->value_a.len, 1);
+            break;
+        default:
+            node->value_i = value->value_i;
+            break;
+    }
+    return b->error ? NBT_VISIT_STOP : NBT_VISIT_CONTINUE;
+}
+
+int LIBNBT_flat_on_begin_compound(void* user) {
+    NBT_Flat_Builder* b = user;
+    if (LIBNBT_flat_add(b, TAG_Compound) == NULL) {
+        return NBT_VISIT_STOP;
+    }
+    b->open[b->depth ++] = b->flat->count - 1;
+    return NBT_VISIT_CONTINUE;
+}
+
+int LIBNBT_flat_on_begin_list(void* user, NBT_Tags type, int32_t count) {
+    NBT_Flat_Builder* b = user;
+    NBT_Flat_Node* node = LIBNBT_flat_add(b, TAG_List);
+    if (node == NULL) {
+        return NBT_VISIT_STOP;
+    }
+    (void)count;
+    node->listtype = isValidTag(type) ? type : TAG_End;
+    b->open[b->depth ++] = b->flat->count - 1;
+    return NBT_VISIT_CONTINUE;
+}
+
+int LIBNBT_flat_on_end(void* user) {
+    NBT_Flat_Builder* b = user;
+    b->depth --;
+    b->flat->nodes[b->open[b->depth]].end = b->flat->count;
+    return NBT_VISIT_CONTINUE;
+}
+
+NBT_Flat* NBT_Parse_Flat(uint8_t* data, size_t length, NBT_Error* errid) {
+    NBT_Flat_Builder b;
+    b.flat = LIBNBT_flat_init();
+    b.depth = 0;
+    b.key = 0;
+    b.keylen = 0;
+    b.error = 0;
+    if (b.flat == NULL) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        return NULL;
+    }
+    NBT_Visitor visitor = {
+        LIBNBT_flat_on_key, LIBNBT_flat_on_value,
+        LIBNBT_flat_on_begin_compound, LIBNBT_flat_on_end,
+        LIBNBT_flat_on_begin_list, LIBNBT_flat_on_end
+    };
+    int ret = NBT_ParseEvents(data, length, &visitor, &b, errid);
+    if (ret == 0 && b.error) {
+        ret = b.error;
+        LIBNBT_fill_err(errid, ret, 0);
+    }
+    if (ret) {
+        NBT_Flat_Free(b.flat);
+        return NULL;
+    }
+    return b.flat;
+}
+
+NBT_Flat* NBT_Flatten(NBT* root) {
+    if (root == NULL) {
+        return NULL;
+    }
+    NBT_Flat* flat = LIBNBT_flat_init();
+    if (flat == NULL) {
+        return NULL;
+    }
+    if (LIBNBT_flat_from_tree(flat, root, 1)) {
+        NBT_Flat_Free(flat);
+        return NULL;
+    }
+    return flat;
+}
+
+NBT* NBT_Unflatten(const NBT_Flat* flat) {
+    if (flat == NULL || flat->count == 0) {
+        return NULL;
+    }
+    return LIBNBT_flat_to_tree(flat, 0);
+}
+
+uint32_t NBT_Flat_GetChild(const NBT_Flat* flat, uint32_t node, const char* key) {
+    if (flat == NULL || node >= flat->count || flat->nodes[node].type != TAG_Compound) {
+        return 0;
+    }
+    size_t keylen = strlen(key);
+    uint32_t i;
+    for (i = node + 1; i < flat->nodes[node].end; i = flat->nodes[i].end) {
+        if (flat->nodes[i].keylen == keylen && memcmp(flat->data + flat->nodes[i].key, key, keylen) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+void NBT_Flat_Free(NBT_Flat* flat) {
+    if (flat == NULL) {
+        return;
+    }
+    free(flat->nodes);
+    free(flat->data);
+    free(flat);
+}
+
+int LIBNBT_push_wait(NBT_Parser* p, int state, uint8_t* dest, size_t need) {
+    p->state = state;
+    p->dest = dest ? dest : p->tmp;
+    p->need = need;
+    p->have = 0;
+    p->capacity = need;
+    return 0;
+}
+
+// Open a List/Compound
+int LIBNBT_push_frame(NBT_Parser* p, NBT* node, uint32_t remaining, uint8_t type) {
+    if (p->depth >= LIBNBT_MAX_DEPTH) {
+        return LIBNBT_ERROR_INVALID_DATA;
+    }
+    if (p->depth == p->stacksize) {
+        int stacksize = p->stacksize ? p->stacksize * 2 : 16;
+        NBT_Parse_Frame* stack = realloc(p->stack, sizeof(NBT_Parse_Frame) * stacksize);
+        if (stack == NULL) {
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        p->stack = stack;
+        p->stacksize = stacksize;
+    }
+    p->stack[p->depth].node = node;
+    p->stack[p->depth].last = NULL;
+    p->stack[p->depth].remaining = remaining;
+    p->stack[p->depth].type = type;
+    p->depth ++;
+    return 0;
+}
+
+// Make room for size bytes of the array payload being read. The length prefix is not trusted,
+// so the buffer only grows with the data that actually arrived
+int LIBNBT_push_grow(NBT_Parser* p, size_t size) {
+    size_t capacity = p->capacity;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    if (capacity > p->need) {
+        capacity = p->need;
+    }
+    uint8_t* data = realloc(p->dest, capacity);
+    if (data == NULL) {
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    p->current->value_a.value = data;
+    p->dest = data;
+    p->capacity = capacity;
+    return 0;
+}
+
+// The key of current is read, wait for its payload
+int LIBNBT_push_begin_value(NBT_Parser* p) {
+    NBT* node = p->current;
+    switch (node->type) {
+        case TAG_Byte:
+        case TAG_Short:
+        case TAG_Int:
+        case TAG_Long:
+        case TAG_Float:
+        case TAG_Double:
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_SCALAR, NULL, LIBNBT_TAG_SIZE[node->type]);
+        case TAG_String:
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_STRLEN, NULL, 2);
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array:
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_ARRLEN, NULL, 4);
+        case TAG_List:
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_LISTHDR, NULL, 5);
+        case TAG_Compound: {
+            int ret = LIBNBT_push_frame(p, node, 0, TAG_End);
+            if (ret) {
+                return ret;
+            }
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_TYPE, NULL, 1);
+        }
+        default:
+            return LIBNBT_ERROR_INVALID_DATA;
+    }
+}
+
+// current is complete, go on with its parent
+int LIBNBT_push_value_done(NBT_Parser* p) {
+    while (p->depth > 0) {
+        NBT_Parse_Frame* frame = &p->stack[p->depth - 1];
+        if (frame->node->type == TAG_Compound) {
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_TYPE, NULL, 1);
+        }
+        if (frame->remaining == 0) {
+            // list is complete, it is done as a value of its parent
+            p->depth --;
+            continue;
+        }
+        frame->remaining --;
+        NBT* child = LIBNBT_create_NBT(NULL, frame->type);
+        if (child == NULL) {
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        if (frame->last == NULL) {
+            frame->node->child = child;
+        } else {
+            frame->last->next = child;
+            child->prev = frame->last;
+        }
+        frame->last = child;
+        p->current = child;
+        return LIBNBT_push_begin_value(p);
+    }
+    return LIBNBT_push_wait(p, LIBNBT_PUSH_DONE, NULL, 0);
+}
+
+// The bytes of the current state are all here
+int LIBNBT_push_step(NBT_Parser* p) {
+    NBT_Buffer buffer;
+    buffer.data = p->tmp;
+    buffer.len = sizeof(p->tmp);
+    buffer.pos = 0;
+    NBT* node = p->current;
+
+    switch (p->state) {
+        case LIBNBT_PUSH_TYPE: {
+            uint8_t type = p->tmp[0];
+            if (p->depth > 0 && type == TAG_End) {
+                // end of compound
+                p->depth --;
+                return LIBNBT_push_value_done(p);
+            }
+            if (!isValidTag(type)) {
+                return LIBNBT_ERROR_INVALID_DATA;
+            }
+            NBT* child = LIBNBT_create_NBT(NULL, type);
+            if (child == NULL) {
+                return LIBNBT_ERROR_INTERNAL;
+            }
+            if (p->depth == 0) {
+                p->root = child;
+            } else {
+                NBT_Parse_Frame* frame = &p->stack[p->depth - 1];
+                if (frame->last == NULL) {
+                    frame->node->child = child;
+                } else {
+                    frame->last->next = child;
+                    child->prev = frame->last;
+                }
+                frame->last = child;
+            }
+            p->current = child;
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_KEYLEN, NULL, 2);
+        }
+        case LIBNBT_PUSH_KEYLEN: {
+            uint16_t len;
+            LIBNBT_getUint16(&buffer, &len);
+            if (len == 0) {
+                return LIBNBT_push_begin_value(p);
+            }
+            node->key = malloc(len + 1);
+            if (node->key == NULL) {
+                return LIBNBT_ERROR_INTERNAL;
+            }
+            node->key[len] = 0;
+            node->keylen = len;
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_KEY, (uint8_t*)node->key, len);
+        }
+        case LIBNBT_PUSH_KEY:
+            return LIBNBT_push_begin_value(p);
+        case LIBNBT_PUSH_SCALAR:
+            switch (node->type) {
+                case TAG_Byte: {
+                    uint8_t value;
+                    LIBNBT_getUint8(&buffer, &value);
+                    node->value_i = value;
+                    break;
+                }
+                case TAG_Short: {
+                    uint16_t value;
+                    LIBNBT_getUint16(&buffer, &value);
+                    node->value_i = value;
+                    break;
+                }
+                case TAG_Int: {
+                    uint32_t value;
+                    LIBNBT_getUint32(&buffer, &value);
+                    node->value_i = value;
+                    break;
+                }
+                case TAG_Long: {
+                    uint64_t value;
+                    LIBNBT_getUint64(&buffer, &value);
+                    node->value_i = value;
+                    break;
+                }
+                case TAG_Float: {
+                    float value;
+                    LIBNBT_getFloat(&buffer, &value);
+                    node->value_d = value;
+                    break;
+                }
+                default: {
+                    double value;
+                    LIBNBT_getDouble(&buffer, &value);
+                    node->value_d = value;
+                    break;
+                }
+            }
+            return LIBNBT_push_value_done(p);
+        case LIBNBT_PUSH_STRLEN: {
+            uint16_t len;
+            LIBNBT_getUint16(&buffer, &len);
+            node->value_a.value = malloc(len + 1);
+            if (node->value_a.value == NULL) {
+                return LIBNBT_ERROR_INTERNAL;
+            }
+            node->value_a.len = len + 1;
+            ((char*)node->value_a.value)[len] = 0;
+            return LIBNBT_push_wait(p, LIBNBT_PUSH_DATA, node->value_a.value, len);
+        }
+        case LIBNBT_PUSH_ARRLEN: {
+            uint32_t len;
+            LIBNBT_getUint32(&buffer, &len);
+            size_t size = (size_t)len * LIBNBT_TAG_SIZE[node->type];
+            // start small, LIBNBT_push_grow makes room as the payload arrives
+            size_t capacity = size < LIBNBT_PUSH_CHUNK ? size : LIBNBT_PUSH_CHUNK;
+            node->value_a.value = malloc(capacity ? capacity : 1);
+            if (node->value_a.value == NULL) {
+                return LIBNBT_ERROR_INTERNAL;
+            }
+            node->value_a.len = len;
+            LIBNBT_push_wait(p, LIBNBT_PUSH_DATA, node->value_a.value, size);
+            p->capacity = capacity;
+            return 0;
+        }
+        case LIBNBT_PUSH_DATA:
+            if (node->type == TAG_Int_Array) {
+                LIBNBT_bswap_copy32(node->value_a.value, node->value_a.value, (uint32_t)node->value_a.len);
+            } else if (node->type == TAG_Long_Array) {
+                LIBNBT_bswap_copy64(node->value_a.value, node->value_a.value, (uint32_t)node->value_a.len);
+            }
+            return LIBNBT_push_value_done(p);
+        case LIBNBT_PUSH_LISTHDR: {
+            uint8_t listtype;
+            uint32_t len;
+            LIBNBT_getUint8(&buffer, &listtype);
+            LIBNBT_getUint32(&buffer, &len);
+            if (listtype == TAG_End && len != 0) {
+                return LIBNBT_ERROR_INVALID_DATA;
+            }
+            int ret = LIBNBT_push_frame(p, node, len, listtype);
+            if (ret) {
+                return ret;
             }
-            *dest = result;
-            *destsize = length;
-            return 0;
-        } else if (result == LIBDEFLATE_INSUFFICIENT_SPACE) {
-            sizecur += sizestep;
-            free(buffer);
-            buffer = malloc(sizecur);
-            continue;
-        } else {
-            free(buffer);
-            libdeflate_free_decompressor(decompressor);
-            return -1;
+            return LIBNBT_push_value_done(p);
         }
+        default:
+            return LIBNBT_ERROR_INTERNAL;
     }
 }
 
-int LIBNBT_compress_gzip(uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-    struct libdeflate_compressor * compressor;
-    compressor = libdeflate_alloc_compressor(12);
-
-    size_t len;
-    len = libdeflate_gzip_compress(compressor, src, srcsize, dest, *destsize);
-    libdeflate_free_compressor(compressor);
-
-    if (len == 0) return -1;
-    *destsize = len;
+// Feed uncompressed bytes to the state machine
+int LIBNBT_push_process(NBT_Parser* p, const uint8_t* data, size_t length) {
+    while (length > 0 || (p->need == p->have && p->state != LIBNBT_PUSH_DONE)) {
+        if (p->state == LIBNBT_PUSH_DONE) {
+            p->leftover = 1;
+            return 0;
+        }
+        size_t n = p->need - p->have;
+        if (n > length) {
+            n = length;
+        }
+        if (p->have + n > p->capacity) {
+            int ret = LIBNBT_push_grow(p, p->have + n);
+            if (ret) {
+                return ret;
+            }
+        }
+        memcpy(p->dest + p->have, data, n);
+        p->have += n;
+        p->position += n;
+        data += n;
+        length -= n;
+        if (p->have == p->need) {
+            int ret = LIBNBT_push_step(p);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
     return 0;
 }
 
-int LIBNBT_compress_zlib(uint8_t* dest, size_t* destsize, uint8_t* src, size_t srcsize) {
-    struct libdeflate_compressor * compressor;
-    compressor = libdeflate_alloc_compressor(12);
-
-    size_t len;
-    len = libdeflate_zlib_compress(compressor, src, srcsize, dest, *destsize);
-    libdeflate_free_compressor(compressor);
-
-    if (len == 0) return -1;
-    *destsize = len;
-    return 0;
+NBT_Parser* NBT_Parser_Init(void) {
+    NBT_Parser* p = malloc(sizeof(NBT_Parser));
+    if (p == NULL) {
+        return NULL;
+    }
+    memset(p, 0, sizeof(NBT_Parser));
+    LIBNBT_push_wait(p, LIBNBT_PUSH_TYPE, NULL, 1);
+    return p;
 }
 
+// Pick the compression from the first bytes, same detection as NBT_Parse_Opt
+int LIBNBT_push_detect(NBT_Parser* p) {
+    if (p->headlen == 2 && p->head[0] == 0x1f && p->head[1] == 0x8b) {
+        p->compression = NBT_Compression_GZIP;
+    } else if (p->head[0] == 0x78) {
+        p->compression = NBT_Compression_ZLIB;
+    } else {
+        p->compression = NBT_Compression_NONE;
+    }
+#ifndef LIBNBT_USE_LIBDEFLATE
+    if (p->compression != NBT_Compression_NONE) {
+        p->inflated = malloc(LIBNBT_PUSH_CHUNK);
+        if (p->inflated == NULL) {
+            return LIBNBT_ERROR_UNZIP_ERROR;
+        }
+        if (inflateInit2(&p->strm, 15 | 32) != Z_OK) {
+            free(p->inflated);
+            p->inflated = NULL;
+            return LIBNBT_ERROR_UNZIP_ERROR;
+        }
+    }
 #endif
-
-int NBT_toSNBT_Opt(NBT* root, char* buff, size_t* bufflen, int maxlevel, int space, NBT_Error* errid) {
-    NBT_Buffer *buffer = LIBNBT_init_buffer((uint8_t*)buff, *bufflen);
-    int ret;
-    ret = LIBNBT_snbt_write_nbt(buffer, root, maxlevel, space, 0);
-    LIBNBT_fill_err(errid, ret, buffer->pos);
-    buffer->data[buffer->pos - 1] = 0;
-    *bufflen = buffer->pos;
-    return ret;
+    // the detected bytes are fed as input again
+    return LIBNBT_push_feed(p, p->head, p->headlen);
 }
 
-int NBT_toSNBT(NBT* root, char* buff, size_t* bufflen) {
-    return NBT_toSNBT_Opt(root, buff, bufflen, -1, -1, NULL);
-}
-
-NBT* NBT_GetChild(NBT* root, const char* key) {
-    if (root == NULL || root->type != TAG_Compound || root->child == NULL) {
-        return NULL;
-    }
-    NBT* child = root->child;
-    while(child) {
-        if (!strcmp(child->key, key)) {
-            return child;
+// Feed input bytes once the compression is known
+int LIBNBT_push_feed(NBT_Parser* p, const uint8_t* data, size_t length) {
+    int ret = 0;
+    if (p->compression == NBT_Compression_NONE) {
+        ret = LIBNBT_push_process(p, data, length);
+    } else {
+#ifndef LIBNBT_USE_LIBDEFLATE
+        p->strm.next_in = (uint8_t*)data;
+        p->strm.avail_in = length;
+        while (ret == 0 && p->strm.avail_in > 0) {
+            p->strm.next_out = p->inflated;
+            p->strm.avail_out = LIBNBT_PUSH_CHUNK;
+            int zret = inflate(&p->strm, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                ret = LIBNBT_ERROR_UNZIP_ERROR;
+                break;
+            }
+            ret = LIBNBT_push_process(p, p->inflated, LIBNBT_PUSH_CHUNK - p->strm.avail_out);
+            if (zret == Z_STREAM_END) {
+                break;
+            }
         }
-        child = child->next;
+#else
+        if (p->compressedlen + length > p->compressedsize) {
+            size_t size = p->compressedsize ? p->compressedsize : LIBNBT_PUSH_CHUNK;
+            while (size < p->compressedlen + length) {
+                size *= 2;
+            }
+            uint8_t* newbuf = realloc(p->compressed, size);
+            if (newbuf == NULL) {
+                return LIBNBT_ERROR_UNZIP_ERROR;
+            }
+            p->compressed = newbuf;
+            p->compressedsize = size;
+        }
+        memcpy(p->compressed + p->compressedlen, data, length);
+        p->compressedlen += length;
+#endif
     }
-    return NULL;
+    return ret;
 }
 
-NBT* NBT_GetChild_Deep(NBT* root, ...) {
-    va_list va;
-    va_start(va, root);
-    char* temp;
-    NBT* current = root;
-    while ((temp = va_arg(va, char*)) != NULL) {
-        current = NBT_GetChild(current, temp);
-        if (current == NULL) {
-            va_end(va);
-            return NULL;
+int NBT_Parser_Feed(NBT_Parser* p, const uint8_t* data, size_t length) {
+    if (p->error) {
+        return p->error;
+    }
+    if (p->compression == 0) {
+        // gzip is told by two bytes, which may come in separate fragments
+        while (p->headlen < 2 && length > 0) {
+            p->head[p->headlen ++] = *data ++;
+            length --;
+        }
+        if (p->headlen < 2) {
+            return 0;
+        }
+        p->error = LIBNBT_push_detect(p);
+        if (p->error) {
+            return p->error;
         }
     }
-    va_end(va);
-    return current;
+    if (length == 0) {
+        return 0;
+    }
+    p->error = LIBNBT_push_feed(p, data, length);
+    return p->error;
 }
 
-NBT* NBT_Parse_Opt(uint8_t* data, size_t length, NBT_Error* errid) {
-
-    NBT_Buffer* buffer;
-
-    if (length > 1 && data[0] == 0x1f && data[1] == 0x8b) {
-        // file is gzip
-        size_t size;
+NBT* NBT_Parser_Finish(NBT_Parser* p, NBT_Error* errid) {
+    if (p->error == 0 && p->compression == 0 && p->headlen > 0) {
+        // the whole input was a single byte
+        p->error = LIBNBT_push_detect(p);
+    }
+#ifdef LIBNBT_USE_LIBDEFLATE
+    if (p->error == 0 && p->compression != NBT_Compression_NONE && p->compressed) {
         uint8_t* undata;
-        int ret = LIBNBT_decompress_gzip(&undata, &size, data, length);
-        if (ret != 0) {
-            LIBNBT_fill_err(errid, LIBNBT_ERROR_UNZIP_ERROR, 0);
-            return NULL;
-        }
-        buffer = LIBNBT_init_buffer(undata, size);
-    } else if (data[0] == 0x78) {
-        // file is zlib
         size_t size;
-        uint8_t* undata;
-        int ret = LIBNBT_decompress_zlib(&undata, &size, data, length);
-        if (ret != 0) {
-            LIBNBT_fill_err(errid, LIBNBT_ERROR_UNZIP_ERROR, 0);
-            return NULL;
+        NBT_Context ctx;
+        LIBNBT_context_init(&ctx);
+        p->error = LIBNBT_uncompress(&ctx, p->compressed, p->compressedlen, &undata, &size);
+        if (p->error == 0) {
+            p->error = LIBNBT_push_process(p, undata, size);
         }
-        buffer = LIBNBT_init_buffer(undata, size);
-    } else {
-        buffer = LIBNBT_init_buffer(data, length);
+        LIBNBT_context_clear(&ctx);
     }
-
-    NBT* root = LIBNBT_create_NBT(TAG_End);
-    int ret = LIBNBT_parse_value(root, buffer, 0);
-    if (buffer->data != data) {
-        free(buffer->data);
+#endif
+    if (p->error == 0 && p->state != LIBNBT_PUSH_DONE) {
+        p->error = LIBNBT_ERROR_EARLY_EOF;
     }
-
-    if (ret != 0) {
-        LIBNBT_fill_err(errid, ret, buffer->pos);
-        NBT_Free(root);
-        free(buffer);
+    if (p->error) {
+        LIBNBT_fill_err(errid, p->error, p->position);
         return NULL;
-    } else {
-        if (buffer->pos != buffer->len) {
-            LIBNBT_fill_err(errid, LIBNBT_ERROR_LEFTOVER_DATA, buffer->pos);
-        } else {
-            LIBNBT_fill_err(errid, 0, buffer->pos);
-        }
-        free(buffer);
-        return root;
     }
+    LIBNBT_fill_err(errid, p->leftover ? LIBNBT_ERROR_LEFTOVER_DATA : 0, p->position);
+    NBT* root = p->root;
+    p->root = NULL;
+    return root;
 }
 
-NBT* NBT_Parse(uint8_t* data, size_t length) {
-    return NBT_Parse_Opt(data, length, NULL);
+void NBT_Parser_Free(NBT_Parser* p) {
+    if (p->root) {
+        NBT_Free(p->root);
+    }
+    free(p->stack);
+#ifndef LIBNBT_USE_LIBDEFLATE
+    if (p->inflated) {
+        inflateEnd(&p->strm);
+        free(p->inflated);
+    }
+#else
+    free(p->compressed);
+#endif
+    free(p);
 }
 
 void NBT_Free(NBT* root) {
-    if (root->key != NULL) {
+    if (root->flags & NBT_FLAG_DOCUMENT) {
+        // released with its document
+        return;
+    }
+    if (root->key != NULL && !(root->flags & NBT_FLAG_ATOM)) {
         free(root->key);
     }
     switch (root->type) {
@@ -1035,9 +4205,15 @@ void NBT_Free(NBT* root) {
         }
         break;
 
-        case TAG_List:
         case TAG_Compound:
-        if (root->child != NULL) {
+        if ((root->flags & NBT_FLAG_INDEX) && root->index != NULL) {
+            free(root->index);
+        }
+        // fall through
+        case TAG_List:
+        if (root->flags & NBT_FLAG_PACKED) {
+            free(root->packed.value);
+        } else if (root->child != NULL) {
             NBT_Free(root->child);
         }
 
@@ -1056,30 +4232,18 @@ void NBT_Free(NBT* root) {
     free(root);
 }
 
-int LIBNBT_nbt_write_key(NBT_Buffer* buffer, char* key, int type) {
-    int ret = 0;
-    ret = LIBNBT_writeUint8(buffer, type);
-    if (!ret) {
+int LIBNBT_nbt_write_key(NBT_Buffer* buffer, char* key, int keylen, int type) {
+    if (key == NULL || keylen < 0) {
+        keylen = 0;
+    }
+    uint8_t* dest = LIBNBT_reserve(buffer, 3);
+    if (dest == NULL) {
         return LIBNBT_ERROR_BUFFER_OVERFLOW;
     }
-    if (key && key[0]) {
-        int len = strlen(key);
-        ret = LIBNBT_writeUint16(buffer, len);
-        if (!ret) {
-            return LIBNBT_ERROR_BUFFER_OVERFLOW;
-        }
-        int i;
-        for (i = 0; i < len; i ++) {
-            ret = LIBNBT_writeUint8(buffer, key[i]);
-            if (!ret) {
-                return LIBNBT_ERROR_BUFFER_OVERFLOW;
-            }
-        }
-    } else {
-        ret = LIBNBT_writeUint16(buffer, 0);
-        if (!ret) {
-            return LIBNBT_ERROR_BUFFER_OVERFLOW;
-        }
+    dest[0] = type;
+    LIBNBT_STORE16(dest + 1, keylen);
+    if (!LIBNBT_write_elements(buffer, key, 1, keylen)) {
+        return LIBNBT_ERROR_BUFFER_OVERFLOW;
     }
     return 0;
 }
@@ -1113,62 +4277,35 @@ int LIBNBT_nbt_write_point(NBT_Buffer* buffer, double value, char* key, int type
     return 0;
 }
 
-int LIBNBT_nbt_write_array(NBT_Buffer* buffer, void* value, int32_t len, char* key, int type) {
+int LIBNBT_nbt_write_array(NBT_Buffer* buffer, void* value, int32_t len, char* key, int type, int bigendian) {
+    switch(type) {
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array:
+        break;
+        default: return LIBNBT_ERROR_INTERNAL;
+    }
     int ret = LIBNBT_writeUint32(buffer, len);
     if (!ret) {
         return LIBNBT_ERROR_BUFFER_OVERFLOW;
     }
-    switch(type) {
-        case TAG_Byte_Array: {
-            int i;
-            for (i = 0; i < len; i ++) {
-                ret = LIBNBT_writeUint8(buffer, ((uint8_t*)value)[i]);
-                if (!ret) {
-                    return LIBNBT_ERROR_BUFFER_OVERFLOW;
-                }
-            }
-        }
-        break;
-        case TAG_Int_Array: {
-            int i;
-            for (i = 0; i < len; i ++) {
-                ret = LIBNBT_writeUint32(buffer, ((uint32_t*)value)[i]);
-                if (!ret) {
-                    return LIBNBT_ERROR_BUFFER_OVERFLOW;
-                }
-            }
-        }
-        break;
-        case TAG_Long_Array: {
-            int i;
-            for (i = 0; i < len; i ++) {
-                ret = LIBNBT_writeUint64(buffer, ((uint64_t*)value)[i]);
-                if (!ret) {
-                    return LIBNBT_ERROR_BUFFER_OVERFLOW;
-                }
-            }
-        }
-        break;
-        default: return LIBNBT_ERROR_INTERNAL;
+    size_t size = LIBNBT_TAG_SIZE[type];
+    size_t count = (uint32_t)len;
+    if (bigendian) {
+        // already in wire order
+        count *= size;
+        size = 1;
+    }
+    if (!LIBNBT_write_elements(buffer, value, size, count)) {
+        return LIBNBT_ERROR_BUFFER_OVERFLOW;
     }
     return 0;
 }
 
 int LIBNBT_nbt_write_string(NBT_Buffer* buffer, void* value, int32_t len, char* key) {
-    int ret;
-    
-    ret = LIBNBT_writeUint16(buffer, len-1);
-    if (!ret) {
-        return LIBNBT_ERROR_BUFFER_OVERFLOW;
-    }
-    int i;
-    for (i = 0; i < len-1; i ++) {
-        ret = LIBNBT_writeUint8(buffer, ((uint8_t*)value)[i]);
-        if (!ret) {
-            return LIBNBT_ERROR_BUFFER_OVERFLOW;
-        }
-    }
-    if (!ret) {
+    // len counts the ending '\0'
+    size_t size = len > 1 ? (size_t)len - 1 : 0;
+    if (!LIBNBT_writeUint16(buffer, size) || !LIBNBT_write_elements(buffer, value, 1, size)) {
         return LIBNBT_ERROR_BUFFER_OVERFLOW;
     }
     return 0;
@@ -1194,6 +4331,16 @@ int LIBNBT_nbt_write_compound(NBT_Buffer* buffer, NBT* root) {
 
 int LIBNBT_nbt_write_list(NBT_Buffer* buffer, NBT* root) {
     int ret;
+    if (root->flags & NBT_FLAG_PACKED) {
+        // one swap for all elements
+        if (!LIBNBT_writeUint8(buffer, root->packed.type) || !LIBNBT_writeUint32(buffer, root->packed.len)) {
+            return LIBNBT_ERROR_BUFFER_OVERFLOW;
+        }
+        if (!LIBNBT_write_elements(buffer, root->packed.value, LIBNBT_TAG_SIZE[root->packed.type], (uint32_t)root->packed.len)) {
+            return LIBNBT_ERROR_BUFFER_OVERFLOW;
+        }
+        return 0;
+    }
     NBT* child = root->child;
     int count = 0;
     while(child != NULL) {
@@ -1223,10 +4370,18 @@ int LIBNBT_nbt_write_list(NBT_Buffer* buffer, NBT* root) {
     return 0;
 }
 
+// An unparsed payload is still in NBT format, copy it as is
+int LIBNBT_nbt_write_lazy(NBT_Buffer* buffer, NBT* root) {
+    if (!LIBNBT_write_elements(buffer, root->lazy.source->data + root->lazy.offset, 1, root->lazy.len)) {
+        return LIBNBT_ERROR_BUFFER_OVERFLOW;
+    }
+    return 0;
+}
+
 int LIBNBT_nbt_write_nbt(NBT_Buffer* buffer, NBT* root, int writekey) {
     int ret;
     if (writekey) {
-        ret = LIBNBT_nbt_write_key(buffer, root->key, root->type);
+        ret = LIBNBT_nbt_write_key(buffer, root->key, LIBNBT_key_length(root), root->type);
         if (ret) {
             return ret;
         }
@@ -1246,66 +4401,352 @@ int LIBNBT_nbt_write_nbt(NBT_Buffer* buffer, NBT* root, int writekey) {
         if (ret) return ret;
         return 0;
 
-        case TAG_Byte_Array:
-        case TAG_Int_Array:
-        case TAG_Long_Array:
-        ret = LIBNBT_nbt_write_array(buffer, root->value_a.value, root->value_a.len, root->key, root->type);
-        if (ret) return ret;
-        return 0;
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array:
+        ret = LIBNBT_nbt_write_array(buffer, root->value_a.value, root->value_a.len, root->key, root->type, root->flags & NBT_FLAG_BIG_ENDIAN);
+        if (ret) return ret;
+        return 0;
+
+        case TAG_String:
+        ret = LIBNBT_nbt_write_string(buffer, root->value_a.value, root->value_a.len, root->key);
+        if (ret) return ret;
+        return 0;
+
+        case TAG_List:
+        if (root->flags & NBT_FLAG_LAZY) {
+            return LIBNBT_nbt_write_lazy(buffer, root);
+        }
+        ret = LIBNBT_nbt_write_list(buffer, root);
+        if (ret) return ret;
+        return 0;
+
+        case TAG_Compound:
+        if (root->flags & NBT_FLAG_LAZY) {
+            return LIBNBT_nbt_write_lazy(buffer, root);
+        }
+        ret = LIBNBT_nbt_write_compound(buffer, root);
+        if (ret) return ret;
+        return 0;
+
+        default:
+        return LIBNBT_ERROR_INTERNAL;
+    }
+}
+
+// Bytes LIBNBT_nbt_write_nbt writes for root
+size_t LIBNBT_nbt_size(NBT* root, int withkey) {
+    size_t size = 0;
+    if (withkey) {
+        size = 3 + (root->key ? LIBNBT_key_length(root) : 0);
+    }
+    switch (root->type) {
+        case TAG_Byte:
+        case TAG_Short:
+        case TAG_Int:
+        case TAG_Long:
+        case TAG_Float:
+        case TAG_Double:
+            return size + LIBNBT_TAG_SIZE[root->type];
+        case TAG_String:
+            return size + 2 + (root->value_a.len > 0 ? root->value_a.len - 1 : 0);
+        case TAG_Byte_Array:
+        case TAG_Int_Array:
+        case TAG_Long_Array:
+            return size + 4 + (size_t)(uint32_t)root->value_a.len * LIBNBT_TAG_SIZE[root->type];
+        default:
+            break;
+    }
+    if (root->flags & NBT_FLAG_LAZY) {
+        return size + root->lazy.len;
+    }
+    if (root->flags & NBT_FLAG_PACKED) {
+        return size + 5 + (size_t)(uint32_t)root->packed.len * LIBNBT_TAG_SIZE[root->packed.type];
+    }
+    NBT* child;
+    if (root->type == TAG_List) {
+        size += 5;
+        for (child = root->child; child; child = child->next) {
+            size += LIBNBT_nbt_size(child, 0);
+        }
+    } else if (root->type == TAG_Compound) {
+        size += 1;
+        for (child = root->child; child; child = child->next) {
+            size += LIBNBT_nbt_size(child, 1);
+        }
+    }
+    return size;
+}
+
+size_t NBT_PackedSize(NBT* root) {
+    if (root == NULL) {
+        return 0;
+    }
+    return LIBNBT_nbt_size(root, 1);
+}
+
+int NBT_Pack_Opt(NBT* root, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid) {
+    return NBT_Pack_Ctx(NULL, root, buffer, length, compression, errid);
+}
+
+int NBT_Pack_Ctx(NBT_Context* ctx, NBT* root, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid) {
+    NBT_Buffer buf;
+    buf.pos = 0;
+    buf.stream = NULL;
+    if (LIBNBT_FORMAT(compression) == NBT_Compression_NONE) {
+        buf.data = buffer;
+        buf.len = *length;
+        int ret = LIBNBT_nbt_write_nbt(&buf, root, 1);
+        LIBNBT_fill_err(errid, ret, buf.pos);
+        *length = buf.pos;
+        return ret;
+    }
+
+    NBT_Context local;
+    if (ctx == NULL) {
+        LIBNBT_context_init(&local);
+        ctx = &local;
+    }
+    int ret = LIBNBT_pack_staged(ctx, root, LIBNBT_nbt_size(root, 1), buffer, length, compression, errid);
+    if (ctx == &local) {
+        LIBNBT_context_clear(&local);
+    }
+    return ret;
+}
+
+// Compress root, whose uncompressed size is size, staging the uncompressed data in the context
+int LIBNBT_pack_staged(NBT_Context* ctx, NBT* root, size_t size, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid) {
+    NBT_Buffer buf;
+    buf.pos = 0;
+    buf.stream = NULL;
+    buf.len = size;
+    if (LIBNBT_context_grow(&ctx->staging, &ctx->stagingsize, size)) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    buf.data = ctx->staging;
+    int ret = LIBNBT_nbt_write_nbt(&buf, root, 1);
+    LIBNBT_fill_err(errid, ret, buf.pos);
+    if (ret == 0) {
+        ret = LIBNBT_compress(ctx, compression, buffer, length, buf.data, buf.pos);
+    }
+    return ret;
+}
+
+int NBT_Pack_Alloc(NBT* root, uint8_t** buffer, size_t* length, NBT_Compression compression, NBT_Error* errid) {
+    return LIBNBT_pack_alloc(NULL, root, buffer, length, compression, errid);
+}
 
-        case TAG_String:
-        ret = LIBNBT_nbt_write_string(buffer, root->value_a.value, root->value_a.len, root->key);
-        if (ret) return ret;
-        return 0;
+int LIBNBT_pack_alloc(NBT_Context* ctx, NBT* root, uint8_t** buffer, size_t* length, NBT_Compression compression, NBT_Error* errid) {
+    if (root == NULL) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    // measure once, the size is passed on to the staging step
+    size_t size = LIBNBT_nbt_size(root, 1);
+    int compressed = LIBNBT_FORMAT(compression) != NBT_Compression_NONE;
+    size_t packed = compressed ? LIBNBT_COMPRESS_BOUND(size) : size;
+    uint8_t* output = *buffer;
+    int grown = 0;
+    if (output == NULL || *length < packed) {
+        output = realloc(output, packed);
+        if (output == NULL) {
+            LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+            return LIBNBT_ERROR_INTERNAL;
+        }
+        *buffer = output;
+        grown = 1;
+    }
+    int ret;
+    if (!compressed) {
+        ret = NBT_Pack_Ctx(ctx, root, output, &packed, compression, errid);
+    } else {
+        NBT_Context local;
+        if (ctx == NULL) {
+            LIBNBT_context_init(&local);
+            ctx = &local;
+        }
+        ret = LIBNBT_pack_staged(ctx, root, size, output, &packed, compression, errid);
+        if (ctx == &local) {
+            LIBNBT_context_clear(&local);
+        }
+    }
+    if (ret == -1) {
+        // the output is large enough, so the compressor itself failed, errid is not set for that
+        ret = LIBNBT_ERROR_INTERNAL;
+        LIBNBT_fill_err(errid, ret, 0);
+    }
+    if (ret) {
+        return ret;
+    }
+    if (grown && compressed) {
+        // the output was sized for the worst case, give the rest back
+        uint8_t* shrunk = realloc(output, packed);
+        if (shrunk) {
+            *buffer = shrunk;
+        }
+    }
+    *length = packed;
+    return 0;
+}
 
-        case TAG_List:
-        ret = LIBNBT_nbt_write_list(buffer, root);
-        if (ret) return ret;
+int LIBNBT_stream_init(NBT_Stream* stream, const NBT_Sink* sink, int compression) {
+    stream->sink = sink;
+    stream->compression = LIBNBT_FORMAT(compression);
+    stream->total = 0;
+    stream->error = 0;
+    if (stream->compression == NBT_Compression_NONE) {
         return 0;
+    }
+#ifndef LIBNBT_USE_LIBDEFLATE
+    stream->out = malloc(LIBNBT_SINK_CHUNK);
+    if (stream->out == NULL) {
+        return -1;
+    }
+    stream->strm.zalloc = Z_NULL;
+    stream->strm.zfree = Z_NULL;
+    stream->strm.opaque = Z_NULL;
+    // same settings as LIBNBT_compress
+    int gzip = stream->compression == NBT_Compression_GZIP;
+    int ret = deflateInit2(&stream->strm, LIBNBT_level(compression), Z_DEFLATED, gzip ? 15 | 16 : 15, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        free(stream->out);
+        return -1;
+    }
+    return 0;
+#else
+    // libdeflate compresses whole buffers only, see NBT_Pack_ToSink
+    return -1;
+#endif
+}
 
-        case TAG_Compound:
-        ret = LIBNBT_nbt_write_compound(buffer, root);
-        if (ret) return ret;
+// Compress length bytes and pass them to the sink, then end the output if finish is set
+int LIBNBT_stream_write(NBT_Stream* stream, const uint8_t* data, size_t length, int finish) {
+    stream->total += length;
+    if (stream->compression == NBT_Compression_NONE) {
+        if (length && stream->sink->write(stream->sink->user, data, length)) {
+            stream->error = LIBNBT_ERROR_WRITE_ERROR;
+            return -1;
+        }
         return 0;
+    }
+#ifndef LIBNBT_USE_LIBDEFLATE
+    stream->strm.next_in = (uint8_t*)data;
+    stream->strm.avail_in = length;
+    int ret;
+    do {
+        stream->strm.next_out = stream->out;
+        stream->strm.avail_out = LIBNBT_SINK_CHUNK;
+        ret = deflate(&stream->strm, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            stream->error = LIBNBT_ERROR_INTERNAL;
+            return -1;
+        }
+        size_t have = LIBNBT_SINK_CHUNK - stream->strm.avail_out;
+        if (have && stream->sink->write(stream->sink->user, stream->out, have)) {
+            stream->error = LIBNBT_ERROR_WRITE_ERROR;
+            return -1;
+        }
+    } while (stream->strm.avail_out == 0 || (finish && ret != Z_STREAM_END));
+    return 0;
+#else
+    stream->error = LIBNBT_ERROR_INTERNAL;
+    return -1;
+#endif
+}
 
-        default:
-        return LIBNBT_ERROR_INTERNAL;
+void LIBNBT_stream_end(NBT_Stream* stream) {
+#ifndef LIBNBT_USE_LIBDEFLATE
+    if (stream->compression != NBT_Compression_NONE) {
+        deflateEnd(&stream->strm);
+        free(stream->out);
     }
+#endif
 }
 
-int NBT_Pack_Opt(NBT* root, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid) {
-    NBT_Buffer *buf;
-    if (compression == NBT_Compression_NONE) {
-        buf = LIBNBT_init_buffer(buffer, *length);
-    } else {
-        uint8_t* tempbuf = malloc(1 << 20);
-        buf = LIBNBT_init_buffer(tempbuf, 1 << 20);
+int NBT_Pack_ToSink(NBT* root, const NBT_Sink* sink, NBT_Compression compression, NBT_Error* errid) {
+    if (root == NULL || sink == NULL || sink->write == NULL) {
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        return LIBNBT_ERROR_INTERNAL;
     }
     int ret;
-    ret = LIBNBT_nbt_write_nbt(buf, root, 1);
-    LIBNBT_fill_err(errid, ret, buf->pos);
-    
-    if (compression == NBT_Compression_NONE) {
-        *length = buf->pos;
-        free(buf);
+#ifdef LIBNBT_USE_LIBDEFLATE
+    if (LIBNBT_FORMAT(compression) != NBT_Compression_NONE) {
+        // libdeflate has no streaming interface, the output is staged and written at once
+        uint8_t* data = NULL;
+        size_t length = 0;
+        ret = NBT_Pack_Alloc(root, &data, &length, compression, errid);
+        if (ret == 0 && sink->write(sink->user, data, length)) {
+            ret = LIBNBT_ERROR_WRITE_ERROR;
+            LIBNBT_fill_err(errid, ret, 0);
+        }
+        free(data);
         return ret;
-    } else {
-        if (ret != 0) {
-            free(buf);
-            return ret;
+    }
+#endif
+    NBT_Stream stream;
+    NBT_Buffer buf;
+    buf.data = malloc(LIBNBT_SINK_CHUNK);
+    if (buf.data == NULL || LIBNBT_stream_init(&stream, sink, compression)) {
+        free(buf.data);
+        LIBNBT_fill_err(errid, LIBNBT_ERROR_INTERNAL, 0);
+        return LIBNBT_ERROR_INTERNAL;
+    }
+    buf.len = LIBNBT_SINK_CHUNK;
+    buf.pos = 0;
+    buf.stream = &stream;
+
+    ret = LIBNBT_nbt_write_nbt(&buf, root, 1);
+    size_t position = stream.total + buf.pos;
+    if (ret == 0) {
+        LIBNBT_stream_write(&stream, buf.data, buf.pos, 1);
+    }
+    if (stream.error) {
+        // a failed flush shows up as an overflow in the writer
+        ret = stream.error;
+    }
+    LIBNBT_fill_err(errid, ret, position);
+    LIBNBT_stream_end(&stream);
+    free(buf.data);
+    return ret;
+}
+
+int LIBNBT_sink_file(void* user, const uint8_t* data, size_t length) {
+    return fwrite(data, 1, length, (FILE*)user) == length ? 0 : -1;
+}
+
+int LIBNBT_sink_fd(void* user, const uint8_t* data, size_t length) {
+    int fd = (int)(intptr_t)user;
+    while (length) {
+#ifdef _MSC_VER
+        int ret = _write(fd, data, (unsigned int)length);
+#else
+        ssize_t ret = write(fd, data, length);
+#endif
+        if (ret < 0 && errno == EINTR) {
+            continue;
         }
-        if (compression == NBT_Compression_GZIP) {
-            ret = LIBNBT_compress_gzip(buffer, length, buf->data, buf->pos);
-            free(buf->data);
-            free(buf);
-            return ret;
-        } else {
-            ret = LIBNBT_compress_zlib(buffer, length, buf->data, buf->pos);
-            free(buf->data);
-            free(buf);
-            return ret;
+        if (ret <= 0) {
+            return -1;
         }
+        data += ret;
+        length -= ret;
     }
+    return 0;
+}
+
+NBT_Sink NBT_Sink_File(FILE* fp) {
+    NBT_Sink sink;
+    sink.write = LIBNBT_sink_file;
+    sink.user = fp;
+    return sink;
+}
+
+NBT_Sink NBT_Sink_Fd(int fd) {
+    NBT_Sink sink;
+    sink.write = LIBNBT_sink_fd;
+    sink.user = (void*)(intptr_t)fd;
+    return sink;
 }
 
 int NBT_Pack(NBT* root, uint8_t* buffer, size_t* length) {
@@ -1342,10 +4783,13 @@ void MCA_Free(MCA* mca) {
         if (mca->data[i]) {
             NBT_Free(mca->data[i]);
         }
-        if (mca->rawdata[i]) {
+        if (mca->rawdata[i] && !MCA_RAW_MAPPED(mca, i)) {
             free(mca->rawdata[i]);
         }
     }
+    if (mca->mapping) {
+        LIBNBT_unmap_file(mca->mapping, mca->mappinglen);
+    }
     free(mca);
 }
 
@@ -1353,14 +4797,298 @@ int MCA_ParseAll(MCA* mca) {
     int i;
     int errcount = 0;
     NBT_Error error;
+    // one context for all chunks, codec state and the decompression buffer are reused
+    NBT_Context ctx;
+    LIBNBT_context_init(&ctx);
     for (i = 0; i < CHUNKS_IN_REGION; i ++) {
         if (mca->rawdata[i]) {
-            mca->data[i] = NBT_Parse_Opt(mca->rawdata[i], mca->size[i], &error);
+            mca->data[i] = NBT_Parse_Ctx(&ctx, mca->rawdata[i], mca->size[i], &error);
             if (mca->data[i] == NULL) {
                 errcount ++;
             }
         }
     }
+    LIBNBT_context_clear(&ctx);
+    return errcount;
+}
+
+int LIBNBT_cpu_count(void) {
+#ifdef _MSC_VER
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    return 1;
+#endif
+}
+
+void LIBNBT_parallel_worker(NBT_Parallel_Job* job) {
+    NBT_Context ctx;
+    LIBNBT_context_init(&ctx);
+    while (1) {
+        int i = LIBNBT_FETCH_ADD(&job->next);
+        if (i >= job->count) {
+            break;
+        }
+        job->work(job, &ctx, job->order[i]);
+    }
+    LIBNBT_context_clear(&ctx);
+}
+
+#ifndef LIBNBT_NO_THREADS
+#ifdef _MSC_VER
+DWORD WINAPI LIBNBT_parallel_thread(LPVOID arg) {
+    LIBNBT_parallel_worker(arg);
+    return 0;
+}
+#else
+void* LIBNBT_parallel_thread(void* arg) {
+    LIBNBT_parallel_worker(arg);
+    return NULL;
+}
+#endif
+#endif
+
+// Largest chunk first, so that no thread is left with a big one at the end
+int LIBNBT_chunk_compare(const void* a, const void* b) {
+    const uint32_t* x = a;
+    const uint32_t* y = b;
+    if (x[0] != y[0]) {
+        return x[0] < y[0] ? 1 : -1;
+    }
+    return x[1] < y[1] ? -1 : 1;
+}
+
+// Run job->work on every chunk with a weight, on nthreads threads (the calling one included)
+void LIBNBT_parallel_run(NBT_Parallel_Job* job, int nthreads) {
+    uint32_t chunks[CHUNKS_IN_REGION][2];
+    int i;
+    job->count = 0;
+    job->next = 0;
+    memset(job->errors, 0, sizeof(job->errors));
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        if (job->weight[i]) {
+            chunks[job->count][0] = job->weight[i];
+            chunks[job->count][1] = i;
+            job->count ++;
+        }
+    }
+    qsort(chunks, job->count, sizeof(chunks[0]), LIBNBT_chunk_compare);
+    for (i = 0; i < job->count; i ++) {
+        job->order[i] = chunks[i][1];
+    }
+
+    if (nthreads <= 0) {
+        nthreads = LIBNBT_cpu_count();
+    }
+    if (nthreads > job->count) {
+        nthreads = job->count;
+    }
+    if (nthreads > LIBNBT_MAX_THREADS) {
+        nthreads = LIBNBT_MAX_THREADS;
+    }
+
+#ifndef LIBNBT_NO_THREADS
+    // if a thread can not be started, the others take its share
+    LIBNBT_Thread threads[LIBNBT_MAX_THREADS];
+    int started = 0;
+    for (i = 1; i < nthreads; i ++) {
+#ifdef _MSC_VER
+        threads[started] = CreateThread(NULL, 0, LIBNBT_parallel_thread, job, 0, NULL);
+        if (threads[started] == NULL) {
+            break;
+        }
+#else
+        if (pthread_create(&threads[started], NULL, LIBNBT_parallel_thread, job)) {
+            break;
+        }
+#endif
+        started ++;
+    }
+    LIBNBT_parallel_worker(job);
+    for (i = 0; i < started; i ++) {
+#ifdef _MSC_VER
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+#else
+    LIBNBT_parallel_worker(job);
+#endif
+}
+
+void LIBNBT_parallel_parse(NBT_Parallel_Job* job, NBT_Context* ctx, int index) {
+    MCA* mca = job->mca;
+    mca->data[index] = NBT_Parse_Ctx(ctx, mca->rawdata[index], mca->size[index], &job->errors[index]);
+}
+
+int MCA_ParseAll_Parallel(MCA* mca, int nthreads, NBT_Error* errors) {
+    NBT_Parallel_Job* job = malloc(sizeof(NBT_Parallel_Job));
+    if (job == NULL) {
+        return -1;
+    }
+    int i;
+    job->mca = mca;
+    job->work = LIBNBT_parallel_parse;
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        job->weight[i] = mca->rawdata[i] ? mca->size[i] + 1 : 0;
+    }
+    LIBNBT_parallel_run(job, nthreads);
+    // same count as MCA_ParseAll, a chunk with leftover data is still parsed
+    int errcount = 0;
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        if (mca->rawdata[i] && mca->data[i] == NULL) {
+            errcount ++;
+        }
+    }
+    if (errors) {
+        memcpy(errors, job->errors, sizeof(job->errors));
+    }
+    free(job);
+    return errcount;
+}
+
+// The old raw data is only replaced once the chunk is packed
+void LIBNBT_parallel_pack(NBT_Parallel_Job* job, NBT_Context* ctx, int index) {
+    MCA* mca = job->mca;
+    uint8_t* data = NULL;
+    size_t size = 0;
+    if (LIBNBT_pack_alloc(ctx, mca->data[index], &data, &size, job->compression, &job->errors[index])) {
+        free(data);
+        return;
+    }
+    if (!MCA_RAW_MAPPED(mca, index)) {
+        free(mca->rawdata[index]);
+    }
+    mca->rawdata[index] = data;
+    mca->size[index] = size;
+}
+
+int MCA_PackAll(MCA* mca, NBT_Compression compression, int nthreads, NBT_Error* errors) {
+    NBT_Parallel_Job* job = malloc(sizeof(NBT_Parallel_Job));
+    if (job == NULL) {
+        return -1;
+    }
+    int i;
+    job->mca = mca;
+    job->work = LIBNBT_parallel_pack;
+    job->compression = compression;
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        job->weight[i] = mca->data[i] ? LIBNBT_nbt_size(mca->data[i], 1) : 0;
+    }
+    LIBNBT_parallel_run(job, nthreads);
+    int errcount = 0;
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        if (job->errors[i].errid) {
+            errcount ++;
+        }
+    }
+    if (errors) {
+        memcpy(errors, job->errors, sizeof(job->errors));
+    }
+    free(job);
+    return errcount;
+}
+
+// Convert a double read from the data to an integer column, saturated. NaN becomes 0
+int64_t LIBNBT_double_to_int64(double value) {
+    if (value != value) {
+        return 0;
+    }
+    // 2^63 is exact as a double, INT64_MAX is not
+    if (value >= 9223372036854775808.0) {
+        return INT64_MAX;
+    }
+    if (value <= -9223372036854775808.0) {
+        return INT64_MIN;
+    }
+    return (int64_t)value;
+}
+
+int MCA_ExtractColumns(MCA* mca, MCA_Column* columns, int count) {
+    const char** paths = malloc(sizeof(const char*) * count);
+    NBT_Value* values = malloc(sizeof(NBT_Value) * count);
+    if (paths == NULL || values == NULL) {
+        free(paths);
+        free(values);
+        return -1;
+    }
+    int i, j;
+    for (j = 0; j < count; j ++) {
+        paths[j] = columns[j].path;
+        memset(columns[j].present, 0, sizeof(columns[j].present));
+    }
+
+    int errcount = 0;
+    // one context for all chunks, codec state and the decompression buffer are reused
+    NBT_Context ctx;
+    LIBNBT_context_init(&ctx);
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        if (mca->rawdata[i] == NULL) {
+            continue;
+        }
+        if (NBT_Extract_Ctx(&ctx, mca->rawdata[i], mca->size[i], paths, count, values, NULL)) {
+            errcount ++;
+            continue;
+        }
+        for (j = 0; j < count; j ++) {
+            MCA_Column* column = &columns[j];
+            switch (values[j].type) {
+                case TAG_Byte:
+                case TAG_Short:
+                case TAG_Int:
+                case TAG_Long:
+                    if (column->value_i) {
+                        column->value_i[i] = values[j].value_i;
+                    }
+                    if (column->value_d) {
+                        column->value_d[i] = (double)values[j].value_i;
+                    }
+                    break;
+                case TAG_Float:
+                case TAG_Double:
+                    if (column->value_i) {
+                        column->value_i[i] = LIBNBT_double_to_int64(values[j].value_d);
+                    }
+                    if (column->value_d) {
+                        column->value_d[i] = values[j].value_d;
+                    }
+                    break;
+                default:
+                    // not found, or not a number
+                    continue;
+            }
+            column->present[i / 32] |= (uint32_t)1 << (i % 32);
+        }
+    }
+    LIBNBT_context_clear(&ctx);
+    free(paths);
+    free(values);
+    return errcount;
+}
+
+int MCA_Validate(MCA* mca, NBT_Error* errors) {
+    int i;
+    int errcount = 0;
+    NBT_Error error;
+    // one context for all chunks, codec state and the decompression buffer are reused
+    NBT_Context ctx;
+    LIBNBT_context_init(&ctx);
+    for (i = 0; i < CHUNKS_IN_REGION; i ++) {
+        error.errid = 0;
+        error.position = 0;
+        if (mca->rawdata[i] && NBT_Validate_Ctx(&ctx, mca->rawdata[i], mca->size[i], &error)) {
+            errcount ++;
+        }
+        if (errors) {
+            errors[i] = error;
+        }
+    }
+    LIBNBT_context_clear(&ctx);
     return errcount;
 }
 
@@ -1443,6 +5171,11 @@ chunk_error: {
 }
 
 int MCA_ReadRaw(uint8_t* data, size_t length, MCA* mca, int skip_chunk_error) {
+    return LIBNBT_mca_read(data, length, mca, skip_chunk_error, 1);
+}
+
+// Fill rawdata/size/epoch from a whole region file. With copy == 0 the chunks point into data
+int LIBNBT_mca_read(uint8_t* data, size_t length, MCA* mca, int skip_chunk_error, int copy) {
 
     memset(mca->rawdata, 0, sizeof(uint8_t*) * CHUNKS_IN_REGION);
     memset(mca->size, 0, sizeof(uint32_t) * CHUNKS_IN_REGION);
@@ -1454,7 +5187,8 @@ int MCA_ReadRaw(uint8_t* data, size_t length, MCA* mca, int skip_chunk_error) {
     uint64_t offsets[CHUNKS_IN_REGION];
 
     int j;
-    NBT_Buffer *buffer = LIBNBT_init_buffer(data, length);
+    NBT_Buffer buffer_s = {data, length, 0, NULL};
+    NBT_Buffer* buffer = &buffer_s;
     for (j = 0; j < CHUNKS_IN_REGION; j ++) {
         uint32_t temp = 0;
         int ret = LIBNBT_getUint32(buffer, &temp);
@@ -1504,25 +5238,110 @@ int MCA_ReadRaw(uint8_t* data, size_t length, MCA* mca, int skip_chunk_error) {
         if ((ret == 0 || type != 2) && !skip_chunk_error) {
             goto chunk_error;
         }
-        
-        mca->rawdata[j] = malloc(tsize - 1);
-        mca->size[j] = tsize - 1;
 
-        memcpy(mca->rawdata[j], data + offsets[j] + 5, mca->size[j]);
+        // the chunk must lie within the file, a mapping can not be read past its end
+        if (tsize == 0 || offsets[j] + 5 > length || tsize - 1 > length - offsets[j] - 5) {
+            if (skip_chunk_error) continue;
+            else goto chunk_error;
+        }
+
+        mca->size[j] = tsize - 1;
+        if (copy) {
+            mca->rawdata[j] = malloc(tsize - 1);
+            memcpy(mca->rawdata[j], data + offsets[j] + 5, mca->size[j]);
+        } else {
+            mca->rawdata[j] = data + offsets[j] + 5;
+        }
 
     }
     return 0;
 chunk_error: {
     int i;
     for (i = 0; i <= j; i ++) {
-        if (mca->rawdata[i]) {
+        if (copy && mca->rawdata[i]) {
             free(mca->rawdata[i]);
         }
+        mca->rawdata[i] = NULL;
+        mca->size[i] = 0;
     }
     return LIBNBT_ERROR_INVALID_DATA;
     }
 }
 
+// Map a whole file read only, NULL if it can not be opened or is too small to be a region
+uint8_t* LIBNBT_map_file(const char* filename, size_t* length) {
+#ifdef _MSC_VER
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 8192 || (uint64_t)size.QuadPart > SIZE_MAX) {
+        CloseHandle(file);
+        return NULL;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    // the view keeps the mapping alive
+    uint8_t* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == NULL) {
+        return NULL;
+    }
+    *length = (size_t)size.QuadPart;
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 8192 || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_WILLNEED
+    // most chunks are going to be read, let the kernel read ahead
+    madvise(data, st.st_size, MADV_WILLNEED);
+#endif
+    *length = st.st_size;
+    return data;
+#endif
+}
+
+void LIBNBT_unmap_file(uint8_t* data, size_t length) {
+#ifdef _MSC_VER
+    (void)length;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, length);
+#endif
+}
+
+MCA* MCA_Open(const char* filename, int skip_chunk_error) {
+    size_t length = 0;
+    uint8_t* data = LIBNBT_map_file(filename, &length);
+    if (data == NULL) {
+        return NULL;
+    }
+    MCA* mca = MCA_Init(filename);
+    mca->mapping = data;
+    mca->mappinglen = length;
+    if (LIBNBT_mca_read(data, length, mca, skip_chunk_error, 0)) {
+        MCA_Free(mca);
+        return NULL;
+    }
+    return mca;
+}
+
 int MCA_WriteRaw_File(FILE* fp, MCA* mca) {
     if (mca == NULL || fp == NULL) {
         return LIBNBT_ERROR_INVALID_DATA;
@@ -35,6 +35,13 @@ typedef enum NBT_Compression {
     NBT_Compression_NONE = 3,
 } NBT_Compression;
 
+// Compression effort of pack, OR'ed into an NBT_Compression, eg. NBT_Compression_ZLIB | NBT_LEVEL_FAST.
+// Without one, gzip is packed at NBT_LEVEL_MAX and zlib at NBT_LEVEL_BALANCED (NBT_LEVEL_MAX with libdeflate)
+#define NBT_LEVEL_FAST      0x0100  // zlib and libdeflate level 1
+#define NBT_LEVEL_BALANCED  0x0200  // zlib and libdeflate level 6
+#define NBT_LEVEL_MAX       0x0300  // zlib level 9, libdeflate level 12
+#define NBT_LEVEL_MASK      0x0f00
+
 // Error code
 #define LIBNBT_ERROR_MASK 0xf0000000
 #define LIBNBT_ERROR_INTERNAL          (LIBNBT_ERROR_MASK|0x1)  // Internal error, maybe a bug?
@@ -43,17 +50,40 @@ typedef enum NBT_Compression {
 #define LIBNBT_ERROR_INVALID_DATA      (LIBNBT_ERROR_MASK|0x4)  // Invalid data detected, maybe the file is corrupted
 #define LIBNBT_ERROR_BUFFER_OVERFLOW   (LIBNBT_ERROR_MASK|0x5)  // The buffer you allocated is not enough, please use a larger buffer
 #define LIBNBT_ERROR_UNZIP_ERROR       (LIBNBT_ERROR_MASK|0x6)  // Occurs when the NBT file is compressed, but failed to decompress, the file is corrupted.
+#define LIBNBT_ERROR_WRITE_ERROR       (LIBNBT_ERROR_MASK|0x7)  // The sink of NBT_Pack_ToSink failed to write, see NBT_Sink
 
 // There's always 1024 (32*32) chunks in a region file
 #define CHUNKS_IN_REGION 1024
 
+// NBT node flags, see NBT.flags
+#define NBT_FLAG_DOCUMENT   0x0001  // Node memory belongs to an NBT_Document, NBT_Free ignores it
+#define NBT_FLAG_VIEW       0x0002  // Key and String/Byte_Array (and big endian array) data point into the parsed buffer, and are not '\0' ended
+#define NBT_FLAG_LAZY       0x0004  // List/Compound whose children are not parsed yet, use NBT_GetFirstChild
+#define NBT_FLAG_BIG_ENDIAN 0x0008  // Int_Array/Long_Array data is in big endian (file) order, use NBT_GetArray*
+#define NBT_FLAG_INDEX      0x0010  // Compound whose children are looked up through a hash index, see NBT_EnableIndex
+#define NBT_FLAG_ATOM       0x0020  // Key is a shared atom of an NBT_Atoms table, not owned by the node
+#define NBT_FLAG_PACKED     0x0040  // List of numbers stored as one array, see NBT_GetListData
+
+// Document parse options, see NBT_Document_Init_Opt
+#define NBT_PARSE_ZEROCOPY   0x0001 // Keys, strings and byte arrays are views into the (decompressed) input
+#define NBT_PARSE_LAZY       0x0002 // Children of Lists and Compounds are parsed when first accessed
+#define NBT_PARSE_RAW_ARRAYS 0x0004 // Int and long arrays are kept big endian (views too, with NBT_PARSE_ZEROCOPY)
+#define NBT_PARSE_INDEX      0x0008 // Compounds with many children get a hash index for NBT_GetChild
+#define NBT_PARSE_PACK_LISTS 0x0010 // Lists of numbers are stored as one array instead of child nodes
+
 // NBT data structure
 typedef struct NBT {
 
     // NBT tag. see the enum above
     enum NBT_Tags type;
 
-    // NBT tag name. Nullable when no name defined. '\0' ended
+    // NBT_FLAG_* bits, 0 for nodes created by NBT_Parse or by hand
+    uint16_t flags;
+
+    // length of key, filled by the parser. Use it instead of strlen when NBT_FLAG_VIEW is set
+    uint16_t keylen;
+
+    // NBT tag name. Nullable when no name defined. '\0' ended unless NBT_FLAG_VIEW is set
     char* key;
 
     // NBT tag data.
@@ -67,13 +97,33 @@ typedef struct NBT {
 
         // Array data, used when tag=[TAG_Byte_Array, TAG_Int_Array, TAG_Long_Array, TAG_String]
         // Note: when using TAG_String, value_a.len equals 1 + string length, because of the ending '\0'
+        // (with NBT_FLAG_VIEW set, value_a.len is still 1 + string length, but the string is not '\0' ended)
         struct {
             void* value;
             int32_t len;
         }value_a;
 
-        // pointer to child. used when tag=[TAG_Compound, TAG_List]
-        struct NBT *child;
+        // used when tag=[TAG_Compound, TAG_List]
+        struct {
+            // pointer to child
+            struct NBT *child;
+            // hash index of the children of a TAG_Compound, NULL until built. See NBT_EnableIndex
+            struct NBT_Index *index;
+        };
+
+        // elements of a TAG_List of numbers when NBT_FLAG_PACKED is set, in host byte order. See NBT_GetListData
+        struct {
+            void* value;
+            int32_t len;
+            uint8_t type;
+        }packed;
+
+        // unparsed payload, used internally by TAG_Compound and TAG_List when NBT_FLAG_LAZY is set
+        struct {
+            struct NBT_Source* source;
+            uint32_t offset;
+            uint32_t len;
+        }lazy;
     };
 
     // if this NBT tag is inside a list or compound, these two links are used to denote its siblings
@@ -81,6 +131,58 @@ typedef struct NBT {
     struct NBT *prev;
 } NBT;
 
+// A node of NBT_Flat. Nodes are stored in pre-order: the first child of a List/Compound
+// is the node right after it, and the node at end is its next sibling, if any
+typedef struct NBT_Flat_Node {
+
+    // NBT tag. see the enum above
+    uint8_t type;
+
+    // element type of a TAG_List, TAG_End when empty
+    uint8_t listtype;
+
+    // length of key
+    uint16_t keylen;
+
+    // offset of the '\0' ended key in NBT_Flat.data, 0 when no key defined (an empty string there)
+    uint32_t key;
+
+    // index of the node after the last one of this subtree
+    uint32_t end;
+
+    // children of List/Compound, elements of arrays, length of strings without the ending '\0'
+    uint32_t len;
+
+    union {
+        // numerical data, used when tag=[TAG_Byte, TAG_Short, TAG_Int, TAG_Long], sign extended
+        int64_t value_i;
+
+        // used when tag=[TAG_Float, TAG_Double]
+        double value_d;
+
+        // used when tag=[TAG_Byte_Array, TAG_Int_Array, TAG_Long_Array, TAG_String], offset of the data in NBT_Flat.data.
+        // Arrays are in host byte order and 8 bytes aligned, strings are '\0' ended
+        uint32_t offset;
+    };
+} NBT_Flat_Node;
+
+// A whole NBT tree in two blocks, see NBT_Parse_Flat
+typedef struct NBT_Flat {
+    // nodes[0] is the root
+    NBT_Flat_Node* nodes;
+    uint32_t count;
+    // keys, strings and arrays
+    uint8_t* data;
+    uint32_t datalen;
+    // allocated sizes, used internally
+    uint32_t nodesize;
+    uint32_t datasize;
+} NBT_Flat;
+
+// Key and string/array data of node i
+#define NBT_FLAT_KEY(flat, i) ((const char*)(flat)->data + (flat)->nodes[i].key)
+#define NBT_FLAT_DATA(flat, i) ((void*)((flat)->data + (flat)->nodes[i].offset))
+
 typedef struct MCA {
     // raw nbt data
     uint8_t* rawdata[CHUNKS_IN_REGION];
@@ -94,8 +196,108 @@ typedef struct MCA {
     uint8_t hasPosition;
     int x;
     int z;
+    // region file mapped by MCA_Open, NULL otherwise
+    uint8_t* mapping;
+    size_t mappinglen;
 } MCA;
 
+// Whether the raw data of chunk i points into the file mapped by MCA_Open, it must not be freed or written then
+#define MCA_RAW_MAPPED(mca, i) ((mca)->mapping && (mca)->rawdata[i] >= (mca)->mapping && (mca)->rawdata[i] < (mca)->mapping + (mca)->mappinglen)
+
+// A column of MCA_ExtractColumns, a number of every chunk in a region
+typedef struct MCA_Column {
+
+    // path of the number in each chunk, same as NBT_Extract
+    const char* path;
+
+    // arrays of CHUNKS_IN_REGION entries provided by the caller, either can be NULL.
+    // Integers and floating point numbers are converted to fit, out of range floating point numbers
+    // are clamped to INT64_MIN/INT64_MAX in value_i, and NaN becomes 0
+    int64_t* value_i;
+    double* value_d;
+
+    // filled by MCA_ExtractColumns, see MCA_COLUMN_HAS
+    uint32_t present[CHUNKS_IN_REGION / 32];
+} MCA_Column;
+
+// Whether chunk i has a number in the column
+#define MCA_COLUMN_HAS(column, i) (((column)->present[(i) / 32] >> ((i) % 32)) & 1)
+
+// A value found by NBT_Extract
+typedef struct NBT_Value {
+
+    // NBT tag of the value, TAG_End when the path is not found
+    enum NBT_Tags type;
+
+    // offset of the value in the (decompressed) data. For strings and arrays, offset of the first element
+    size_t offset;
+
+    union {
+        // used when tag=[TAG_Byte, TAG_Short, TAG_Int, TAG_Long], sign extended
+        int64_t value_i;
+
+        // used when tag=[TAG_Float, TAG_Double]
+        double value_d;
+
+        // used when tag=[TAG_Byte_Array, TAG_Int_Array, TAG_Long_Array, TAG_String, TAG_List, TAG_Compound]
+        // value points into the data, into the context's buffer for compressed data with NBT_Extract_Ctx,
+        // or is NULL for compressed data without a context. Arrays are not byte swapped,
+        // strings are not '\0' ended (len is still 1 + string length), and for List/Compound len is the payload size in bytes
+        struct {
+            void* value;
+            int32_t len;
+        }value_a;
+    };
+} NBT_Value;
+
+// Return values of NBT_Visitor callbacks
+#define NBT_VISIT_CONTINUE  0   // Go on
+#define NBT_VISIT_SKIP      1   // From key/begin_compound/begin_list: skip the value, or the rest of it
+#define NBT_VISIT_STOP      2   // Stop parsing
+
+// Callbacks of NBT_ParseEvents, called in stream order. Any of them can be NULL.
+// Data passed to them (keys, strings, arrays) is only valid during the call.
+typedef struct NBT_Visitor {
+
+    // name of the next tag, for the root tag and children of compounds. key is not '\0' ended
+    int (*key)(void* user, const char* key, int keylen, NBT_Tags type);
+
+    // a tag which is not a list or compound, in the same form as NBT_Extract results
+    int (*value)(void* user, const NBT_Value* value);
+
+    // a compound. If begin_compound returns NBT_VISIT_SKIP, its children and end_compound are skipped
+    int (*begin_compound)(void* user);
+    int (*end_compound)(void* user);
+
+    // a list of count elements of type. If begin_list returns NBT_VISIT_SKIP, its elements and end_list are skipped
+    int (*begin_list)(void* user, NBT_Tags type, int32_t count);
+    int (*end_list)(void* user);
+} NBT_Visitor;
+
+// Destination of NBT_Pack_ToSink. write is called with the output in pieces, in order,
+// and returns 0 on success. See NBT_Sink_File and NBT_Sink_Fd for the common ones
+typedef struct NBT_Sink {
+    int (*write)(void* user, const uint8_t* data, size_t length);
+    void* user;
+} NBT_Sink;
+
+// A push parser, which accepts NBT data in fragments of any size
+typedef struct NBT_Parser NBT_Parser;
+
+// A table of interned keys, shared by the trees parsed with it
+typedef struct NBT_Atoms NBT_Atoms;
+
+// A compiled path for NBT_Eval, see NBT_CompilePath
+typedef struct NBT_Path NBT_Path;
+
+// A parsed document. All nodes, keys and payloads are carved out of one growable
+// arena owned by the document, so the whole tree is released at once.
+typedef struct NBT_Document NBT_Document;
+
+// Compressor/decompressor state and scratch buffers reused by the _Ctx functions.
+// A context is not thread safe, use one per thread
+typedef struct NBT_Context NBT_Context;
+
 typedef struct NBT_Error {
     // Error ID, see above
     int errid;
@@ -105,19 +307,76 @@ typedef struct NBT_Error {
 
 NBT*  NBT_Parse(uint8_t* data, size_t length);
 NBT*  NBT_Parse_Opt(uint8_t* data, size_t length, NBT_Error* err);
+NBT*  NBT_Parse_Ctx(NBT_Context* ctx, uint8_t* data, size_t length, NBT_Error* err);
+NBT*  NBT_Parse_Atoms(uint8_t* data, size_t length, NBT_Atoms* atoms, NBT_Error* err);
+int   NBT_Validate(uint8_t* data, size_t length, NBT_Error* err);
+int   NBT_Validate_Ctx(NBT_Context* ctx, uint8_t* data, size_t length, NBT_Error* err);
+NBT_Atoms* NBT_Atoms_Init(void);
+const char* NBT_Atoms_Intern(NBT_Atoms* atoms, const char* key);
+void  NBT_Atoms_Free(NBT_Atoms* atoms);
 void  NBT_Free(NBT* root);
+NBT_Document* NBT_Document_Init(void);
+NBT_Document* NBT_Document_Init_Opt(int flags);
+NBT*  NBT_Parse_Document(NBT_Document* doc, uint8_t* data, size_t length, NBT_Error* err);
+NBT*  NBT_Parse_Document_Ctx(NBT_Context* ctx, NBT_Document* doc, uint8_t* data, size_t length, NBT_Error* err);
+void  NBT_Document_SetAtoms(NBT_Document* doc, NBT_Atoms* atoms);
+void  NBT_Document_Reset(NBT_Document* doc);
+void  NBT_Document_Free(NBT_Document* doc);
+NBT_Context* NBT_Context_Init(void);
+void  NBT_Context_SizeHint(NBT_Context* ctx, size_t size);
+void  NBT_Context_Free(NBT_Context* ctx);
 int   NBT_Pack(NBT* root, uint8_t* buffer, size_t* length);
 int   NBT_Pack_Opt(NBT* root, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid);
+int   NBT_Pack_Ctx(NBT_Context* ctx, NBT* root, uint8_t* buffer, size_t* length, NBT_Compression compression, NBT_Error* errid);
+int   NBT_Pack_Alloc(NBT* root, uint8_t** buffer, size_t* length, NBT_Compression compression, NBT_Error* errid);
+size_t NBT_PackedSize(NBT* root);
+int   NBT_Pack_ToSink(NBT* root, const NBT_Sink* sink, NBT_Compression compression, NBT_Error* errid);
+NBT_Sink NBT_Sink_File(FILE* fp);
+NBT_Sink NBT_Sink_Fd(int fd);
 NBT*  NBT_GetChild(NBT* root, const char* key);
+NBT*  NBT_GetChild_Atom(NBT* root, const char* atom);
+NBT*  NBT_GetFirstChild(NBT* root);
 NBT*  NBT_GetChild_Deep(NBT* root, ...);
+NBT_Path* NBT_CompilePath(const char* path);
+NBT*  NBT_Eval(const NBT_Path* path, NBT* root);
+void  NBT_FreePath(NBT_Path* path);
+int   NBT_EnableIndex(NBT* root);
+void  NBT_DropIndex(NBT* root);
+int   NBT_AddChild(NBT* root, NBT* child);
+int   NBT_RemoveChild(NBT* root, NBT* child);
+int32_t NBT_GetArrayInt(NBT* root, int32_t index);
+int64_t NBT_GetArrayLong(NBT* root, int32_t index);
+int32_t NBT_GetArrayRange(NBT* root, int32_t start, int32_t count, void* out);
+const void* NBT_GetListData(NBT* root, NBT_Tags* type, int32_t* len);
+int64_t NBT_GetListInt(NBT* root, int32_t index);
+double NBT_GetListDouble(NBT* root, int32_t index);
+int   NBT_PackList(NBT* root);
+int   NBT_UnpackList(NBT* root);
+int   NBT_Extract(uint8_t* data, size_t length, const char** paths, int count, NBT_Value* out, NBT_Error* err);
+int   NBT_Extract_Ctx(NBT_Context* ctx, uint8_t* data, size_t length, const char** paths, int count, NBT_Value* out, NBT_Error* err);
+int   NBT_ParseEvents(uint8_t* data, size_t length, const NBT_Visitor* visitor, void* user, NBT_Error* err);
+NBT_Parser* NBT_Parser_Init(void);
+int   NBT_Parser_Feed(NBT_Parser* parser, const uint8_t* data, size_t length);
+NBT*  NBT_Parser_Finish(NBT_Parser* parser, NBT_Error* err);
+void  NBT_Parser_Free(NBT_Parser* parser);
+NBT_Flat* NBT_Parse_Flat(uint8_t* data, size_t length, NBT_Error* err);
+NBT_Flat* NBT_Flatten(NBT* root);
+NBT*  NBT_Unflatten(const NBT_Flat* flat);
+uint32_t NBT_Flat_GetChild(const NBT_Flat* flat, uint32_t node, const char* key);
+void  NBT_Flat_Free(NBT_Flat* flat);
 int   NBT_toSNBT(NBT* root, char* buff, size_t* bufflen);
 int   NBT_toSNBT_Opt(NBT* root, char* buff, size_t* bufflen, int maxlevel, int space, NBT_Error* errid);
 MCA*  MCA_Init(const char* filename);
 MCA*  MCA_Init_WithPos(int x, int z);
 int   MCA_ReadRaw(uint8_t* data, size_t length, MCA* mca, int skip_chunk_error);
 int   MCA_ReadRaw_File(FILE* fp, MCA* mca, int skip_chunk_error);
+MCA*  MCA_Open(const char* filename, int skip_chunk_error);
 int   MCA_WriteRaw_File(FILE* fp, MCA* mca);
 int   MCA_ParseAll(MCA* mca);
+int   MCA_ParseAll_Parallel(MCA* mca, int nthreads, NBT_Error* errors);
+int   MCA_PackAll(MCA* mca, NBT_Compression compression, int nthreads, NBT_Error* errors);
+int   MCA_ExtractColumns(MCA* mca, MCA_Column* columns, int count);
+int   MCA_Validate(MCA* mca, NBT_Error* errors);
 void  MCA_Free(MCA* mca);
 
 #ifdef __cplusplus